@@ -1,13 +1,97 @@
 #include "BackupManager.hpp"
 #include "FoldersManager.hpp"
+#include "JournalManager.hpp"
+#include "SnapshotManager.hpp"
+#include "SqliteManager.hpp"
+#include <cerrno>
 #include <filesystem>
 #include <fstream>
 #include <iostream>
+#include <stdexcept>
+#include <unistd.h>
 
 namespace AN {
 
+std::unique_ptr<BackupManager> makeBackupManager(const std::string &backend,
+                                                 fs::path backupFile) {
+  if (backend == "json")
+    return std::make_unique<JsonManager>(backupFile);
+  if (backend == "journal")
+    return std::make_unique<JournalManager>(backupFile);
+  if (backend == "snapshot")
+    return std::make_unique<SnapshotManager>(backupFile);
+  if (backend == "sqlite")
+    return std::make_unique<SqliteManager>(backupFile);
+  throw std::invalid_argument("Unknown backup backend: " + backend);
+}
+
+bool writeAll(int fd, std::string_view data) {
+  while (!data.empty()) {
+    ssize_t num = write(fd, data.data(), data.size());
+    if (num == -1) {
+      if (errno == EINTR)
+        continue;
+      return false;
+    }
+    data.remove_prefix(num);
+  }
+  return true;
+}
+
+void fingerprintToJson(const FileFingerprint &fingerprint, Json &json) {
+  json["mtime_ns"] = fingerprint.mtimeNs;
+  json["size"] = fingerprint.size;
+  json["inode"] = fingerprint.inode;
+  json["hash"] = fingerprint.contentHash;
+}
+
+FileFingerprint fingerprintFromJson(const Json &json) {
+  FileFingerprint fingerprint;
+  fingerprint.mtimeNs = json.value("mtime_ns", fingerprint.mtimeNs);
+  fingerprint.size = json.value("size", fingerprint.size);
+  fingerprint.inode = json.value("inode", fingerprint.inode);
+  fingerprint.contentHash = json.value("hash", fingerprint.contentHash);
+  return fingerprint;
+}
+
+void dirStampToJson(const DirStamp &stamp, Json &json) {
+  json["mtime_ns"] = stamp.mtimeNs;
+  json["inode"] = stamp.inode;
+  json["links"] = stamp.linkCount;
+}
+
+DirStamp dirStampFromJson(const Json &json) {
+  DirStamp stamp;
+  stamp.mtimeNs = json.value("mtime_ns", stamp.mtimeNs);
+  stamp.inode = json.value("inode", stamp.inode);
+  stamp.linkCount = json.value("links", stamp.linkCount);
+  return stamp;
+}
+
+void ledgerEntryToJson(const LedgerEntry &entry, Json &json) {
+  json["state"] = processStateName(entry.state);
+  json["attempts"] = entry.attempts;
+  json["error"] = entry.lastError;
+}
+
+LedgerEntry ledgerEntryFromJson(const Json &json) {
+  LedgerEntry entry;
+  entry.state = processStateFromName(json.value("state", ""))
+                    .value_or(ProcessDiscovered);
+  entry.attempts = json.value("attempts", entry.attempts);
+  entry.lastError = json.value("error", entry.lastError);
+  return entry;
+}
+
+const Json &JsonManager::getScanList() const {
+  // const lookups only, scanners for different roots restore concurrently
+  static const Json empty = Json::array();
+  auto scanList = m_jsonIn.find("folder_scan_list");
+  return scanList != m_jsonIn.end() ? *scanList : empty;
+}
+
 bool JsonManager::isMonitoredRoot(fs::path path) {
-  for (const Json folderScanner : m_jsonIn["folder_scan_list"]) {
+  for (const Json &folderScanner : getScanList()) {
     if (folderScanner["folder_root"] == path.string()) {
       return true;
     }
@@ -15,37 +99,46 @@ bool JsonManager::isMonitoredRoot(fs::path path) {
   return false;
 }
 
-std::vector<std::pair<fs::path, time_t>>
+std::vector<std::pair<fs::path, FileFingerprint>>
 JsonManager::getRootMonitoredFiles(fs::path path) {
-  std::vector<std::pair<fs::path, time_t>> pathsAndTimes;
+  std::vector<std::pair<fs::path, FileFingerprint>> pathsAndTimes;
 
-  for (const Json &folderScanner : m_jsonIn["folder_scan_list"]) {
+  for (const Json &folderScanner : getScanList()) {
     if (folderScanner["folder_root"] != path.string())
       continue;
 
     for (const Json &jPathsAndTimes : folderScanner["paths_and_times"]) {
       fs::path path(jPathsAndTimes["path"]);
-      time_t time(jPathsAndTimes["time"].template get<int>());
-
-      pathsAndTimes.emplace_back(std::tuple(path, time));
+      pathsAndTimes.emplace_back(path, fingerprintFromJson(jPathsAndTimes));
     }
   }
   return pathsAndTimes;
 }
 
-FSEventStreamEventId JsonManager::getLastObservedEventId() {
-  // FSEventStreamEventId lastEvent = m_json.contains("lasteventid") ?
-  // static_cast<FSEventStreamEventId>(m_json["lasteventid"]) :
-  // kFSEventStreamEventIdSinceNow;
-  FSEventStreamEventId lastEvent;
-  if (m_jsonIn.contains("lasteventid")) {
-    lastEvent = static_cast<FSEventStreamEventId>(m_jsonIn["lasteventid"].template get<FSEventStreamEventId>());
-    std::cout << "restoring latest event id: " << lastEvent;
-  } else {
-    lastEvent = kFSEventStreamEventIdSinceNow;
-    std::cout << "starting timestamp now: " << lastEvent << "\n";
+void JsonManager::forEachRootDir(
+    const fs::path &root,
+    const std::function<void(std::string_view, const DirStamp &)> &visit) {
+  for (const Json &folderScanner : getScanList()) {
+    if (folderScanner["folder_root"] != root.string())
+      continue;
+    auto dirs = folderScanner.find("dirs");
+    if (dirs == folderScanner.end())
+      continue;
+    for (const Json &dir : *dirs) {
+      visit(dir["path"].template get_ref<const std::string &>(),
+            dirStampFromJson(dir));
+    }
   }
-  return lastEvent;
+}
+
+EventId JsonManager::getLastObservedEventId() {
+  // written as lasteventid before
+  for (const char *key : {"last_event_id", "lasteventid"}) {
+    auto lastEvent = m_jsonIn.find(key);
+    if (lastEvent != m_jsonIn.end())
+      return lastEvent->template get<EventId>();
+  }
+  return EventIdSinceNow;
 }
 
 JsonManager::JsonManager(fs::path backupFile) {
@@ -64,23 +157,49 @@ void JsonManager::updateBackup() {
 }
 
 void JsonManager::getFolderScannerUpdate(FolderScanner &scanner) {
-  auto filesAndTimes = scanner.getFilesAndTimes();
   fs::path root = scanner.getRoot();
   Json entry;
   entry["folder_root"] = root;
-  for (const std::pair<fs::path, time_t> &fileAndTime : filesAndTimes) {
+  scanner.forEachFile([&entry](const fs::path &path,
+                                const FileFingerprint &fingerprint) {
     Json fileEntry;
-    fileEntry["path"] = fileAndTime.first.string();
-    fileEntry["time"] = fileAndTime.second;
+    fileEntry["path"] = path.string();
+    fingerprintToJson(fingerprint, fileEntry);
     entry["paths_and_times"].push_back(fileEntry);
-  }
-  if (entry.contains("paths_and_times")) {
+  });
+  scanner.forEachDir([&entry](const fs::path &dir, const DirStamp &stamp) {
+    Json dirEntry;
+    dirEntry["path"] = dir.string();
+    dirStampToJson(stamp, dirEntry);
+    entry["dirs"].push_back(dirEntry);
+  });
+  if (entry.contains("paths_and_times") || entry.contains("dirs")) {
     m_jsonOut["folder_scan_list"].push_back(entry);
   }
 }
 
 void JsonManager::getFolderManagerUpdate(FoldersManager &manager) {
   m_jsonOut["last_event_id"] = manager.getLatestEventId();
+  Json &ledger = m_jsonOut["ledger"] = Json::array();
+  manager.getLedger().forEachEntry(
+      [&ledger](std::string_view path, const LedgerEntry &entry) {
+        Json ledgerEntry;
+        ledgerEntry["path"] = std::string(path);
+        ledgerEntryToJson(entry, ledgerEntry);
+        ledger.push_back(ledgerEntry);
+      });
+}
+
+void JsonManager::forEachLedgerEntry(
+    const std::function<void(std::string_view, const LedgerEntry &)> &visit) {
+  auto ledger = m_jsonIn.find("ledger");
+  if (ledger == m_jsonIn.end())
+    return;
+  for (const Json &ledgerEntry : *ledger) {
+    const std::string &path =
+        ledgerEntry["path"].template get_ref<const std::string &>();
+    visit(path, ledgerEntryFromJson(ledgerEntry));
+  }
 }
 
 } // namespace AN
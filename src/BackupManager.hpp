@@ -1,7 +1,12 @@
 #pragma once
-#include <CoreServices/CoreServices.h>
+#include "EventSource.hpp"
+#include "Fingerprint.hpp"
+#include "ProcessingLedger.hpp"
 #include <filesystem>
+#include <functional>
+#include <memory>
 #include <nlohmann/json.hpp>
+#include <string>
 #include <vector>
 
 namespace AN {
@@ -11,18 +16,38 @@ using Json = nlohmann::json; // json is type, so capitalize...
 // TODO eg json format:
 /*
 {
-  "lasteventid": num,
+  "last_event_id": num,
   "folder_scan_list": [
     { // NOTE each of these is a single FolderScanner
       "folder_root": "str",
       "paths_and_times": [
         {
           "path": "str",
-          "time": num,
+          "mtime_ns": num,
+          "size": num,
+          "inode": num,
+          "hash": num, (0 unless hashed, see ChangeDetection)
         },
       ,...
+      ],
+      "dirs": [ // see DirStamp, folders listed in full
+        {
+          "path": "str",
+          "mtime_ns": num,
+          "inode": num,
+          "links": num,
+        },
       ]
     } FolderScanner
+  ],
+  "ledger": [ // see ProcessingLedger, only files not yet done
+    {
+      "path": "str",
+      "state": "discovered" | "stable" | "queued" | "running" | "failed" |
+               "dead",
+      "attempts": num,
+      "error": "str",
+    },
   ]
 }
 */
@@ -39,43 +64,113 @@ class FoldersManager;
 class BackupManager {
 public:
   virtual ~BackupManager() {};
-  // TODO wrap linux handling with inotify here
-  virtual FSEventStreamEventId getLastObservedEventId() = 0;
-  // is this path the root of some FolderScanner? If not, toss when loading
+  virtual EventId getLastObservedEventId() = 0;
+  // is this path the root of some FolderScanner? If not, toss when loading.
+  // This and the restore calls below may come from several scanners starting
+  // up at once
   virtual bool isMonitoredRoot(fs::path path) = 0;
 
-  // get files and timestamps monitored under given root dir
-  virtual std::vector<std::pair<fs::path, time_t>>
+  // get files and fingerprints monitored under given root dir
+  virtual std::vector<std::pair<fs::path, FileFingerprint>>
   getRootMonitoredFiles(fs::path path) = 0;
+  // same without building the vector. Backends that can hand out views
+  // straight into their storage override this
+  virtual void forEachRootFile(
+      const fs::path &root,
+      const std::function<void(std::string_view, const FileFingerprint &)>
+          &visit) {
+    for (const auto &[path, fingerprint] : getRootMonitoredFiles(root)) {
+      visit(path.native(), fingerprint);
+    }
+  };
+
+  // folder stamps saved for root, restored by the FolderScanner constructor
+  // for FolderScanner::scanChanged. None (a backend or an old backup without
+  // them) means the root is scanned in full
+  virtual void forEachRootDir(
+      const fs::path &,
+      const std::function<void(std::string_view, const DirStamp &)> &) {};
 
   // query new folders to add to me
   virtual void getFolderManagerUpdate(FoldersManager &manager) = 0;
   virtual void getFolderScannerUpdate(FolderScanner &scanner) = 0;
   virtual void updateBackup() = 0;
+
+  // incremental backends record changes as they happen rather than querying
+  // everything at the end. May be called from several scanner threads
+  virtual void fileUpdated(const fs::path &, const fs::path &,
+                           const FileFingerprint &) {};
+  // likewise for folder stamps, an unknown stamp replaces any saved one
+  virtual void dirUpdated(const fs::path &, const fs::path &,
+                          const DirStamp &) {};
+  // make everything recorded so far durable, called after each scan batch
+  virtual void flush() {};
+
+  // ProcessingLedger entries saved last time. Files without one had nothing
+  // left to do
+  virtual void forEachLedgerEntry(
+      const std::function<void(std::string_view, const LedgerEntry &)>
+          &visit) = 0;
+  // incremental backends save each ledger change as it happens, nullptr once
+  // the file is done and its entry can go. Called from the executor threads
+  // too
+  virtual void ledgerUpdated(const fs::path &, const LedgerEntry *) {};
 };
 
+// write all of data to fd, looping since write() may do less than asked.
+// For the file based backends
+bool writeAll(int fd, std::string_view data);
+// fingerprint as "mtime_ns", "size", "inode" and "hash" fields of a file's
+// json object, for the json based backends. Reading one from before they
+// were kept (just "time") gives an unknown fingerprint
+void fingerprintToJson(const FileFingerprint &fingerprint, Json &json);
+FileFingerprint fingerprintFromJson(const Json &json);
+// folder stamp as "mtime_ns", "inode" and "links" fields likewise
+void dirStampToJson(const DirStamp &stamp, Json &json);
+DirStamp dirStampFromJson(const Json &json);
+// ledger entry as "state", "attempts" and "error" fields likewise. An
+// unrecognised state reads back as discovered, so the file is looked at again
+void ledgerEntryToJson(const LedgerEntry &entry, Json &json);
+LedgerEntry ledgerEntryFromJson(const Json &json);
+
+// backend is "json" (default), "journal", "snapshot" or "sqlite", see
+// SettingsManager
+std::unique_ptr<BackupManager> makeBackupManager(const std::string &backend,
+                                                 fs::path backupFile);
+
 class JsonManager : public BackupManager {
 public:
   JsonManager() {};
   JsonManager(fs::path backupFile);
   ~JsonManager() {};
 
-  FSEventStreamEventId getLastObservedEventId() override;
+  EventId getLastObservedEventId() override;
 
   bool isMonitoredRoot(fs::path path) override;
 
-  std::vector<std::pair<fs::path, time_t>>
+  std::vector<std::pair<fs::path, FileFingerprint>>
   getRootMonitoredFiles(fs::path path) override;
+  void forEachRootDir(
+      const fs::path &root,
+      const std::function<void(std::string_view, const DirStamp &)> &visit)
+      override;
 
   void getFolderManagerUpdate(FoldersManager &manager) override;
   void getFolderScannerUpdate(FolderScanner &scanner) override;
   void updateBackup() override;
 
+  void forEachLedgerEntry(
+      const std::function<void(std::string_view, const LedgerEntry &)> &visit)
+      override;
+
 private:
   fs::path m_backupFile{}; // file to source from/to
   // loaded from file into json (keep separate from output for backup/crash)
   Json m_jsonIn{};
   Json m_jsonOut{};
+
+  // m_jsonIn's folder_scan_list, or an empty one
+  const Json &getScanList() const;
 };
 
 } // namespace AN
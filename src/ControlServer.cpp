@@ -0,0 +1,469 @@
+#include "ControlServer.hpp"
+
+#include <cerrno>
+#include <cstring>
+#include <fcntl.h>
+#include <iostream>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+#include <vector>
+
+#ifdef __linux__
+#include <sys/epoll.h>
+#endif
+
+namespace AN {
+
+// connections waiting for accept()
+constexpr int ListenBacklog = 64;
+
+static void setNonBlocking(int fd) {
+  fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+  fcntl(fd, F_SETFD, FD_CLOEXEC);
+}
+
+static void appendFrame(std::string &out, uint16_t type,
+                        std::string_view payload) {
+  FrameHeader header{ProtocolVersion, type,
+                     static_cast<uint32_t>(payload.size())};
+  out.append(reinterpret_cast<const char *>(&header), sizeof(header));
+  out.append(payload);
+}
+
+bool sendFrame(int fd, uint16_t type, std::string_view payload) {
+  if (payload.size() > MaxFrameLength)
+    return false;
+  std::string frame;
+  appendFrame(frame, type, payload);
+  std::string_view remaining = frame;
+  while (!remaining.empty()) {
+    ssize_t num = send(fd, remaining.data(), remaining.size(), 0);
+    if (num == -1) {
+      if (errno == EINTR)
+        continue;
+      return false;
+    }
+    remaining.remove_prefix(num);
+  }
+  return true;
+}
+
+// read exactly size bytes, false on EOF or error
+static bool recvAll(int fd, char *data, size_t size) {
+  while (size > 0) {
+    ssize_t num = recv(fd, data, size, 0);
+    if (num == 0)
+      return false;
+    if (num == -1) {
+      if (errno == EINTR)
+        continue;
+      return false;
+    }
+    data += num;
+    size -= num;
+  }
+  return true;
+}
+
+std::optional<Frame> recvFrame(int fd) {
+  FrameHeader header;
+  if (!recvAll(fd, reinterpret_cast<char *>(&header), sizeof(header)) ||
+      header.version != ProtocolVersion || header.length > MaxFrameLength)
+    return std::nullopt;
+  Frame frame{header.type, std::string(header.length, '\0')};
+  if (!recvAll(fd, frame.payload.data(), frame.payload.size()))
+    return std::nullopt;
+  return frame;
+}
+
+// readiness of a set of fds, epoll where there is one
+class ControlServer::Poller {
+public:
+  struct Ready {
+    int fd;
+    bool readable; // or hung up/errored, a read finds out which
+    bool writable;
+  };
+
+#ifdef __linux__
+  Poller() : m_epollFd(epoll_create1(EPOLL_CLOEXEC)) {}
+  ~Poller() {
+    if (m_epollFd != -1)
+      close(m_epollFd);
+  }
+  bool isValid() const { return m_epollFd != -1; }
+
+  void add(int fd) { control(EPOLL_CTL_ADD, fd, true, false); }
+  void setInterest(int fd, bool wantRead, bool wantWrite) {
+    control(EPOLL_CTL_MOD, fd, wantRead, wantWrite);
+  }
+  void remove(int fd) { epoll_ctl(m_epollFd, EPOLL_CTL_DEL, fd, nullptr); }
+
+  std::vector<Ready> wait() {
+    std::vector<Ready> ready;
+    struct epoll_event events[64];
+    int count = epoll_wait(m_epollFd, events, std::size(events), -1);
+    if (count == -1 && errno != EINTR) {
+      std::cerr << "epoll_wait() error: " << strerror(errno) << "\n";
+    }
+    for (int i = 0; i < count; ++i) {
+      uint32_t flags = events[i].events;
+      ready.push_back({events[i].data.fd,
+                       (flags & (EPOLLIN | EPOLLHUP | EPOLLERR)) != 0,
+                       (flags & EPOLLOUT) != 0});
+    }
+    return ready;
+  }
+
+private:
+  int m_epollFd;
+
+  void control(int operation, int fd, bool wantRead, bool wantWrite) {
+    struct epoll_event event{};
+    // hangups and errors are reported either way
+    event.events = (wantRead ? static_cast<uint32_t>(EPOLLIN) : 0) |
+                   (wantWrite ? static_cast<uint32_t>(EPOLLOUT) : 0);
+    event.data.fd = fd;
+    if (epoll_ctl(m_epollFd, operation, fd, &event) == -1) {
+      std::cerr << "epoll_ctl() error: " << strerror(errno) << "\n";
+    }
+  }
+#else
+  bool isValid() const { return true; }
+
+  void add(int fd) { m_interests[fd] = {true, false}; }
+  void setInterest(int fd, bool wantRead, bool wantWrite) {
+    m_interests[fd] = {wantRead, wantWrite};
+  }
+  void remove(int fd) { m_interests.erase(fd); }
+
+  std::vector<Ready> wait() {
+    std::vector<struct pollfd> pollFds;
+    pollFds.reserve(m_interests.size());
+    for (const auto &[fd, interest] : m_interests) {
+      // hangups and errors are reported either way
+      short events = (interest.first ? POLLIN : 0) |
+                     (interest.second ? POLLOUT : 0);
+      pollFds.push_back({fd, events, 0});
+    }
+    std::vector<Ready> ready;
+    if (poll(pollFds.data(), pollFds.size(), -1) == -1 && errno != EINTR) {
+      std::cerr << "poll() error: " << strerror(errno) << "\n";
+      return ready;
+    }
+    for (const auto &pollFd : pollFds) {
+      if (pollFd.revents) {
+        ready.push_back({pollFd.fd,
+                         (pollFd.revents & (POLLIN | POLLHUP | POLLERR)) != 0,
+                         (pollFd.revents & POLLOUT) != 0});
+      }
+    }
+    return ready;
+  }
+
+private:
+  std::unordered_map<int, std::pair<bool, bool>> m_interests; // read, write
+#endif
+};
+
+ControlServer::ControlServer(fs::path socketPath, Handler handler)
+    : m_socketPath(std::move(socketPath)), m_handler(std::move(handler)),
+      m_poller(std::make_unique<Poller>()) {}
+
+ControlServer::~ControlServer() {
+  for (const auto &fdAndConnection : m_connections) {
+    close(fdAndConnection.first);
+  }
+  if (m_listenFd != -1) {
+    close(m_listenFd);
+    unlink(m_socketPath.c_str());
+  }
+  for (int fd : m_wakePipe) {
+    if (fd != -1)
+      close(fd);
+  }
+}
+
+bool ControlServer::listen() {
+  if (!m_poller->isValid()) {
+    std::cerr << "Unable to create event loop: " << strerror(errno) << "\n";
+    return false;
+  }
+  struct sockaddr_un local{};
+  local.sun_family = AF_UNIX;
+  if (m_socketPath.native().size() >= sizeof(local.sun_path)) {
+    std::cerr << "Socket path too long: " << m_socketPath << "\n";
+    return false;
+  }
+  strcpy(local.sun_path, m_socketPath.c_str());
+  socklen_t localLen = SUN_LEN(&local) + 1;
+#ifdef __APPLE__
+  local.sun_len = localLen; // BSD only field
+#endif
+
+  m_listenFd = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (m_listenFd == -1) {
+    std::cerr << "Unable to open socket: " << strerror(errno) << "\n";
+    return false;
+  }
+  // left behind by a previous run that didn't get to clean up
+  unlink(local.sun_path);
+  if (bind(m_listenFd, reinterpret_cast<sockaddr *>(&local), localLen) == -1 ||
+      ::listen(m_listenFd, ListenBacklog) == -1) {
+    std::cerr << "Unable to listen on " << m_socketPath << ": "
+              << strerror(errno) << "\n";
+    return false;
+  }
+  setNonBlocking(m_listenFd);
+
+  // no pipe2 on macOS
+  if (pipe(m_wakePipe) == -1) {
+    std::cerr << "pipe() error: " << strerror(errno) << "\n";
+    return false;
+  }
+  for (int fd : m_wakePipe) {
+    setNonBlocking(fd);
+  }
+  m_poller->add(m_listenFd);
+  m_poller->add(m_wakePipe[0]);
+  return true;
+}
+
+void ControlServer::wakeUp() {
+  char byte = 0;
+  // a full pipe is already going to wake it
+  if (write(m_wakePipe[1], &byte, 1) == -1 && errno != EAGAIN) {
+    std::cerr << "Failed to wake control server: " << strerror(errno) << "\n";
+  }
+}
+
+void ControlServer::stop() {
+  m_isStopping.store(true);
+  wakeUp();
+}
+
+void ControlServer::subscribe(int client) {
+  std::lock_guard<std::mutex> lock(m_subscribersMutex);
+  if (m_subscribers.try_emplace(client).second)
+    m_subscriberCount.fetch_add(1);
+}
+
+void ControlServer::publish(std::string_view payload) {
+  bool needsWake = false;
+  {
+    std::lock_guard<std::mutex> lock(m_subscribersMutex);
+    for (auto &[fd, subscriber] : m_subscribers) {
+      if (subscriber.pending.size() + sizeof(FrameHeader) + payload.size() >
+          SubscriberBufferSize) {
+        ++subscriber.dropped; // it's not keeping up
+        continue;
+      }
+      needsWake = needsWake || subscriber.pending.empty();
+      appendFrame(subscriber.pending, ResponseEvent, payload);
+    }
+  }
+  // once per batch the event loop hasn't picked up yet
+  if (needsWake)
+    wakeUp();
+}
+
+void ControlServer::takeEvents(int fd, Connection &connection) {
+  if (!connection.out.empty() || connection.isClosing)
+    return; // only as fast as it reads them
+  std::lock_guard<std::mutex> lock(m_subscribersMutex);
+  auto it = m_subscribers.find(fd);
+  if (it == m_subscribers.end())
+    return;
+  Subscriber &subscriber = it->second;
+  if (subscriber.dropped > 0) {
+    appendFrame(connection.out, ResponseEventsDropped,
+                std::to_string(subscriber.dropped));
+    subscriber.dropped = 0;
+  }
+  connection.out += subscriber.pending;
+  subscriber.pending.clear(); // keeps its capacity for the next lot
+}
+
+void ControlServer::run() {
+  while (!m_isStopping.load()) {
+    for (const auto &ready : m_poller->wait()) {
+      if (ready.fd == m_listenFd) {
+        acceptClients();
+        continue;
+      }
+      if (ready.fd == m_wakePipe[0]) {
+        // m_isStopping is checked on the way round, otherwise events were
+        // published
+        char buffer[256];
+        while (read(m_wakePipe[0], buffer, sizeof(buffer)) > 0) {
+        }
+        for (auto it = m_connections.begin(); it != m_connections.end();) {
+          int fd = it->first;
+          Connection &connection = (it++)->second;
+          if (!flush(fd, connection))
+            closeConnection(fd);
+        }
+        continue;
+      }
+
+      auto it = m_connections.find(ready.fd);
+      if (it == m_connections.end())
+        continue; // closed earlier in this batch
+      Connection &connection = it->second;
+      bool isOpen = true;
+      // a paused one is only here for a hangup or error, which the write
+      // finds out about
+      if (ready.readable && !connection.isReadPaused)
+        isOpen = readFrom(ready.fd, connection);
+      if (isOpen)
+        isOpen = flush(ready.fd, connection);
+      if (!isOpen)
+        closeConnection(ready.fd);
+    }
+  }
+}
+
+void ControlServer::acceptClients() {
+  while (true) {
+    int fd = accept(m_listenFd, nullptr, nullptr);
+    if (fd == -1) {
+      if (errno == EINTR)
+        continue;
+      if (errno != EAGAIN && errno != EWOULDBLOCK)
+        std::cerr << "Error in client accept(): " << strerror(errno) << "\n";
+      return;
+    }
+    setNonBlocking(fd);
+    m_connections.emplace(fd, Connection{});
+    m_poller->add(fd);
+  }
+}
+
+bool ControlServer::readFrom(int fd, Connection &connection) {
+  char buffer[16 * 1024];
+  while (true) {
+    ssize_t num = read(fd, buffer, sizeof(buffer));
+    if (num > 0) {
+      connection.in.append(buffer, num);
+      // one that never stops writing would keep this going forever. The rest
+      // is still there to be reported once these are answered
+      if (connection.in.size() >= ClientOutputLimit)
+        break;
+      continue;
+    }
+    if (num == 0)
+      return false; // client hung up, whatever's unanswered goes with it
+    if (errno == EINTR)
+      continue;
+    if (errno == EAGAIN || errno == EWOULDBLOCK)
+      break;
+    return false;
+  }
+  return true;
+}
+
+void ControlServer::handleFrames(int fd, Connection &connection) {
+  size_t offset = 0;
+  // past the limit the rest wait in in, and flush comes back for them
+  while (!connection.isClosing && connection.out.size() < ClientOutputLimit &&
+         connection.in.size() - offset >= sizeof(FrameHeader)) {
+    FrameHeader header;
+    memcpy(&header, connection.in.data() + offset, sizeof(header));
+    if (header.version != ProtocolVersion) {
+      // can't trust the rest of what it sends, tell it what we speak
+      appendFrame(connection.out, ResponseBadVersion,
+                  std::to_string(ProtocolVersion));
+      connection.isClosing = true;
+      break;
+    }
+    if (header.length > MaxFrameLength) {
+      appendFrame(connection.out, ResponseError, "frame too long");
+      connection.isClosing = true;
+      break;
+    }
+    if (connection.in.size() - offset - sizeof(header) < header.length)
+      break; // rest of it still to come
+
+    std::string_view payload(connection.in.data() + offset + sizeof(header),
+                             header.length);
+    // header goes in front once we know how long the payload came out
+    size_t responseAt = connection.out.size();
+    connection.out.append(sizeof(FrameHeader), '\0');
+    uint16_t status = m_handler(header.type, payload, fd, connection.out);
+    size_t responseLength =
+        connection.out.size() - responseAt - sizeof(FrameHeader);
+    if (responseLength > MaxFrameLength) {
+      connection.out.resize(responseAt);
+      appendFrame(connection.out, ResponseError, "response too long");
+    } else {
+      FrameHeader responseHeader{ProtocolVersion, status,
+                                 static_cast<uint32_t>(responseLength)};
+      memcpy(connection.out.data() + responseAt, &responseHeader,
+             sizeof(responseHeader));
+    }
+    offset += sizeof(header) + header.length;
+  }
+  connection.in.erase(0, offset);
+}
+
+bool ControlServer::writeTo(int fd, Connection &connection) {
+  size_t written = 0;
+  while (written < connection.out.size()) {
+    ssize_t num = send(fd, connection.out.data() + written,
+                       connection.out.size() - written, 0);
+    if (num == -1) {
+      if (errno == EINTR)
+        continue;
+      if (errno == EAGAIN || errno == EWOULDBLOCK)
+        break;
+      return false;
+    }
+    written += num;
+  }
+  connection.out.erase(0, written);
+  return !(connection.out.empty() && connection.isClosing);
+}
+
+bool ControlServer::flush(int fd, Connection &connection) {
+  // more events (or requests held back by ClientOutputLimit) can pile up
+  // while out drains, and nothing wakes us for them once it has, so keep
+  // going until the socket's full or there are none
+  while (true) {
+    handleFrames(fd, connection);
+    takeEvents(fd, connection);
+    bool hadNothing = connection.out.empty();
+    if (!writeTo(fd, connection))
+      return false;
+    if (hadNothing || !connection.out.empty())
+      break;
+  }
+  updateInterest(fd, connection);
+  return true;
+}
+
+void ControlServer::updateInterest(int fd, Connection &connection) {
+  bool isReadPaused = connection.out.size() >= ClientOutputLimit;
+  // only ask to hear about writability while there's something to write
+  bool wantsWrite = !connection.out.empty();
+  if (isReadPaused == connection.isReadPaused &&
+      wantsWrite == connection.wantsWrite)
+    return;
+  connection.isReadPaused = isReadPaused;
+  connection.wantsWrite = wantsWrite;
+  m_poller->setInterest(fd, !isReadPaused, wantsWrite);
+}
+
+void ControlServer::closeConnection(int fd) {
+  {
+    std::lock_guard<std::mutex> lock(m_subscribersMutex);
+    if (m_subscribers.erase(fd) > 0)
+      m_subscriberCount.fetch_sub(1);
+  }
+  m_poller->remove(fd);
+  close(fd);
+  m_connections.erase(fd);
+}
+
+} // namespace AN
@@ -0,0 +1,141 @@
+#pragma once
+#include <atomic>
+#include <cstdint>
+#include <filesystem>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+
+namespace AN {
+namespace fs = std::filesystem;
+
+// wire format of the control socket. Every message either way is one frame,
+// a FrameHeader (host byte order, it's a local socket) then length bytes of
+// payload. Requests carry a ServerCommands in type, responses a
+// ResponseStatus. A connection stays open for as many requests as the client
+// likes, each answered in order
+struct FrameHeader {
+  uint16_t version; // ProtocolVersion
+  uint16_t type;
+  uint32_t length;
+};
+// bump when frames or a command's payload change incompatibly
+constexpr uint16_t ProtocolVersion = 1;
+// anything claiming to be bigger is garbage, the connection is dropped
+constexpr uint32_t MaxFrameLength = 64 << 20;
+
+enum ResponseStatus : uint16_t {
+  ResponseOk,
+  ResponseError,          // payload says what went wrong
+  ResponseUnknownCommand, // server is older than the client
+  ResponseBadVersion,     // payload is the server's ProtocolVersion
+  // pushed to subscribers, unasked for, see ControlServer::publish
+  ResponseEvent,
+  ResponseEventsDropped, // payload is how many events were missed
+};
+
+struct Frame {
+  uint16_t type{ResponseOk};
+  std::string payload;
+};
+
+// blocking, for the client. sendFrame loops over partial writes, recvFrame
+// returns nullopt on EOF, error, or a frame from another ProtocolVersion
+bool sendFrame(int fd, uint16_t type, std::string_view payload);
+std::optional<Frame> recvFrame(int fd);
+
+// bytes of events a subscriber can have waiting before more are dropped
+constexpr size_t SubscriberBufferSize = 1 << 20;
+// bytes of responses a client can have waiting before its connection stops
+// being read, so one that sends requests without reading the answers can't
+// grow them without limit. Picked up again once it's caught up
+constexpr size_t ClientOutputLimit = 4 << 20;
+
+// unix socket server for the control commands. One thread runs an event
+// loop (epoll on linux, poll() elsewhere) over the listening socket and every
+// client, all nonblocking, so any number of clients can keep connections
+// open without holding each other up. Requests are answered on that thread
+// by the handler, which must be quick and thread safe wrt the rest of the
+// daemon.
+// A client can also subscribe, after which it's sent every publish()ed event
+// as it happens. Each subscriber has SubscriberBufferSize of events waiting
+// to go at most, beyond that events are dropped and it's sent a
+// ResponseEventsDropped before the next ones, rather than holding up the
+// publisher or everyone else
+class ControlServer {
+public:
+  // request type, payload and which client sent it -> ResponseStatus. The
+  // response payload is appended straight to out, the client's output
+  // buffer, which keeps its capacity between requests. Nothing else may be
+  // done with out
+  using Handler = std::function<uint16_t(uint16_t command, std::string_view,
+                                         int client, std::string &out)>;
+
+  ControlServer(fs::path socketPath, Handler handler);
+  ~ControlServer();
+  ControlServer(const ControlServer &) = delete;
+  ControlServer &operator=(const ControlServer &) = delete;
+
+  // bind and listen, replacing any stale socket file. False with the reason
+  // on stderr if not
+  bool listen();
+  // event loop, returns once stop() is called
+  void run();
+  // any thread, including the handler's
+  void stop();
+
+  // from the handler, client gets publish()ed events after the response
+  void subscribe(int client);
+  // queue a ResponseEvent for every subscriber, any thread. Check
+  // hasSubscribers() first to skip building payloads nobody will see
+  void publish(std::string_view payload);
+  bool hasSubscribers() const { return m_subscriberCount.load() > 0; }
+
+private:
+  class Poller;
+  struct Connection {
+    std::string in;  // read but not yet a whole frame
+    std::string out; // responses not yet written
+    bool isClosing{false}; // close once out is written
+    // what the poller's been asked for, see updateInterest
+    bool isReadPaused{false};
+    bool wantsWrite{false};
+  };
+
+  fs::path m_socketPath;
+  Handler m_handler;
+  int m_listenFd{-1};
+  int m_wakePipe[2]{-1, -1}; // stop() -> event loop
+  std::atomic_bool m_isStopping{false};
+  std::unique_ptr<Poller> m_poller;
+  std::unordered_map<int, Connection> m_connections;
+
+  struct Subscriber {
+    std::string pending; // frames waiting for the connection's out to empty
+    uint64_t dropped{0}; // events not sent since the last delivery
+  };
+  std::mutex m_subscribersMutex; // m_subscribers
+  std::unordered_map<int, Subscriber> m_subscribers;
+  std::atomic_size_t m_subscriberCount{0};
+
+  void acceptClients();
+  // false once the connection should be dropped
+  bool readFrom(int fd, Connection &connection);
+  bool writeTo(int fd, Connection &connection);
+  void handleFrames(int fd, Connection &connection);
+  // move fd's waiting events to its out, once out has gone
+  void takeEvents(int fd, Connection &connection);
+  // handleFrames, takeEvents and writeTo until there's nothing or the
+  // socket's full, false once the connection should be dropped
+  bool flush(int fd, Connection &connection);
+  // read while out is under ClientOutputLimit, write while it has anything
+  void updateInterest(int fd, Connection &connection);
+  void wakeUp();
+  void closeConnection(int fd);
+};
+
+} // namespace AN
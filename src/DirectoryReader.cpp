@@ -0,0 +1,115 @@
+#include "DirectoryReader.hpp"
+
+#include <cerrno>
+#include <cstring>
+#include <dirent.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace AN {
+
+#ifdef __linux__
+// a few hundred entries a call on typical name lengths
+constexpr size_t ReadBufferSize = 32 * 1024;
+#endif
+
+DirectoryReader::DirectoryReader(const fs::path &dir) {
+  m_fd = open(dir.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+  if (m_fd == -1) {
+    m_failed = true;
+    m_unopenedStamp = getDirStamp(dir);
+    m_unopenedStamp.mtimeNs = 0;
+    return;
+  }
+#ifdef __linux__
+  m_buffer = std::make_unique<char[]>(ReadBufferSize);
+#else
+  // takes over the fd, closedir closes it
+  m_dir = fdopendir(m_fd);
+  if (!m_dir) {
+    m_unopenedStamp = getDirStamp(m_fd);
+    m_unopenedStamp.mtimeNs = 0;
+    close(m_fd);
+    m_fd = -1;
+    m_failed = true;
+  }
+#endif
+}
+
+DirectoryReader::~DirectoryReader() {
+#ifdef __linux__
+  if (m_fd != -1)
+    close(m_fd);
+#else
+  if (m_dir)
+    closedir(m_dir);
+#endif
+}
+
+DirStamp DirectoryReader::stamp() const {
+  return m_fd != -1 ? getDirStamp(m_fd) : m_unopenedStamp;
+}
+
+// d_type is DT_UNKNOWN on some filesystems (older xfs, some network ones),
+// those need the lstat
+static bool isRealDir(int dirFd, const char *name, unsigned char type) {
+  if (type != DT_UNKNOWN)
+    return type == DT_DIR;
+  struct stat attributes;
+  return fstatat(dirFd, name, &attributes, AT_SYMLINK_NOFOLLOW) == 0 &&
+         S_ISDIR(attributes.st_mode);
+}
+
+static bool isDotOrDotDot(const char *name) {
+  return name[0] == '.' &&
+         (name[1] == '\0' || (name[1] == '.' && name[2] == '\0'));
+}
+
+bool DirectoryReader::next(Entry &entry) {
+  if (m_fd == -1)
+    return false;
+#ifdef __linux__
+  while (true) {
+    if (m_bufferPos >= m_bufferLength) {
+      ssize_t num = getdents64(m_fd, m_buffer.get(), ReadBufferSize);
+      if (num == -1 && errno == EINTR)
+        continue;
+      if (num <= 0) {
+        m_failed = num == -1;
+        return false;
+      }
+      m_bufferLength = num;
+      m_bufferPos = 0;
+    }
+    const auto *dirent =
+        reinterpret_cast<const struct dirent64 *>(m_buffer.get() + m_bufferPos);
+    m_bufferPos += dirent->d_reclen;
+    if (isDotOrDotDot(dirent->d_name))
+      continue;
+    entry.name = dirent->d_name;
+    entry.isDir = isRealDir(m_fd, dirent->d_name, dirent->d_type);
+    return true;
+  }
+#else
+  while (true) {
+    errno = 0;
+    const struct dirent *dirent = readdir(m_dir);
+    if (!dirent) {
+      m_failed = errno != 0;
+      return false;
+    }
+    if (isDotOrDotDot(dirent->d_name))
+      continue;
+    entry.name = dirent->d_name;
+    entry.isDir = isRealDir(m_fd, dirent->d_name, dirent->d_type);
+    return true;
+  }
+#endif
+}
+
+FileFingerprint DirectoryReader::fingerprint(const char *name) const {
+  return getFingerprintAt(m_fd, name);
+}
+
+} // namespace AN
@@ -0,0 +1,56 @@
+#pragma once
+#include "Fingerprint.hpp"
+#include <filesystem>
+#include <memory>
+
+#ifndef __linux__
+#include <dirent.h>
+#endif
+
+namespace AN {
+namespace fs = std::filesystem;
+
+// lists one folder straight off an fd of it, for the scans. On linux the
+// entries are read with getdents64 a buffer at a time, elsewhere with readdir.
+// The type comes with each name (d_type) on most filesystems so folders are
+// told from files without a stat, and files are stat'd relative to the fd
+// (see fingerprint()) rather than by a full path resolved all over again
+class DirectoryReader {
+public:
+  struct Entry {
+    const char *name; // valid until the next call to next()
+    // a real folder, folder symlinks aren't followed so they count as files
+    bool isDir;
+  };
+
+  explicit DirectoryReader(const fs::path &dir);
+  ~DirectoryReader();
+  DirectoryReader(const DirectoryReader &) = delete;
+  DirectoryReader &operator=(const DirectoryReader &) = delete;
+
+  // the folder as opened. Take it before calling next(), so anything changed
+  // while it's read moves it on. If it's there but couldn't be opened (no
+  // permission, out of fds) mtimeNs is 0, so it's still recorded but never
+  // trusted, and unknown if it's gone
+  DirStamp stamp() const;
+  // false once there's nothing left, or on error, see failed(). Skips . and ..
+  bool next(Entry &entry);
+  // couldn't be opened or read to the end
+  bool failed() const { return m_failed; }
+  // fingerprint of an entry (symlinks followed), unknown if it's gone again
+  FileFingerprint fingerprint(const char *name) const;
+
+private:
+  int m_fd{-1};
+  bool m_failed{false};
+  DirStamp m_unopenedStamp{}; // see stamp()
+#ifdef __linux__
+  std::unique_ptr<char[]> m_buffer;
+  size_t m_bufferLength{0}; // filled by the last getdents64
+  size_t m_bufferPos{0};
+#else
+  DIR *m_dir{};
+#endif
+};
+
+} // namespace AN
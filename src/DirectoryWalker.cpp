@@ -0,0 +1,147 @@
+#include "DirectoryWalker.hpp"
+#include "DirectoryReader.hpp"
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <memory>
+#include <thread>
+
+namespace AN {
+
+DirectoryWalker::DirectoryWalker(unsigned threadCount)
+    : m_threadCount(std::max(threadCount, 1u)) {}
+
+std::vector<WalkedFile>
+DirectoryWalker::walk(const fs::path &root,
+                      std::function<bool(std::string_view)> accept,
+                      std::vector<WalkedDir> *dirs,
+                      const std::atomic<bool> *stop) {
+  std::vector<std::unique_ptr<WorkQueue>> queues;
+  for (unsigned i = 0; i < m_threadCount; ++i) {
+    queues.push_back(std::make_unique<WorkQueue>());
+  }
+  std::vector<std::vector<WalkedFile>> results(m_threadCount);
+  std::vector<std::vector<WalkedDir>> dirResults(m_threadCount);
+  // folders queued or being read. Only hits 0 once every thread is out of work
+  std::atomic<size_t> pendingDirs{1};
+  // folders sitting in a queue. Threads out of work sleep on idleCv until
+  // there's one to steal, or pendingDirs hits 0
+  std::atomic<size_t> queuedDirs{1};
+  std::mutex idleMutex;
+  std::condition_variable idleCv;
+  queues[0]->dirs.push_back(root);
+
+  auto wakeIdle = [&](bool all) {
+    // so a thread between checking for work and sleeping can't miss it
+    { std::lock_guard<std::mutex> lock(idleMutex); }
+    if (all)
+      idleCv.notify_all();
+    else
+      idleCv.notify_one();
+  };
+
+  auto worker = [&](unsigned self) {
+    WorkQueue &ownQueue = *queues[self];
+    std::vector<WalkedFile> &ownResults = results[self];
+    std::vector<WalkedDir> &ownDirs = dirResults[self];
+
+    while (true) {
+      fs::path dir;
+      bool found = false;
+      {
+        // own queue newest first, keeps each thread working down one subtree
+        std::lock_guard<std::mutex> lock(ownQueue.mutex);
+        if (!ownQueue.dirs.empty()) {
+          dir = std::move(ownQueue.dirs.back());
+          ownQueue.dirs.pop_back();
+          found = true;
+        }
+      }
+      for (unsigned i = 1; !found && i < m_threadCount; ++i) {
+        // steal the oldest, ie the biggest remaining chunk, from someone else
+        WorkQueue &victim = *queues[(self + i) % m_threadCount];
+        std::lock_guard<std::mutex> lock(victim.mutex);
+        if (!victim.dirs.empty()) {
+          dir = std::move(victim.dirs.front());
+          victim.dirs.pop_front();
+          found = true;
+        }
+      }
+      if (!found) {
+        std::unique_lock<std::mutex> lock(idleMutex);
+        idleCv.wait(lock, [&] {
+          return queuedDirs.load() > 0 || pendingDirs.load() == 0;
+        });
+        if (pendingDirs.load() == 0)
+          return;
+        continue;
+      }
+      queuedDirs.fetch_sub(1);
+      if (stop && stop->load()) {
+        // dropped unread, which soon empties the queues
+        if (pendingDirs.fetch_sub(1) == 1)
+          wakeIdle(true);
+        continue;
+      }
+
+      DirectoryReader reader(dir);
+      // before listing, so anything changed while it's read moves it on
+      DirStamp stamp = dirs ? reader.stamp() : DirStamp{};
+      DirectoryReader::Entry entry;
+      while (reader.next(entry)) {
+        if (entry.isDir) {
+          pendingDirs.fetch_add(1);
+          {
+            std::lock_guard<std::mutex> lock(ownQueue.mutex);
+            ownQueue.dirs.push_back(dir / entry.name);
+            queuedDirs.fetch_add(1);
+          }
+          wakeIdle(false);
+        } else if (accept(entry.name)) {
+          FileFingerprint fingerprint = reader.fingerprint(entry.name);
+          // gone again since the listing
+          if (fingerprint.isKnown())
+            ownResults.push_back({dir / entry.name, fingerprint});
+        }
+      }
+      if (dirs && stamp.isKnown()) {
+        if (reader.failed())
+          stamp.mtimeNs = 0; // see WalkedDir
+        ownDirs.push_back({std::move(dir), stamp});
+      }
+      // children counted before this, so pending can't drop to 0 early
+      if (pendingDirs.fetch_sub(1) == 1)
+        wakeIdle(true);
+    }
+  };
+
+  std::vector<std::thread> threads;
+  for (unsigned i = 1; i < m_threadCount; ++i) {
+    threads.emplace_back(worker, i);
+  }
+  worker(0);
+  for (auto &thread : threads) {
+    thread.join();
+  }
+
+  if (dirs) {
+    for (auto &threadDirs : dirResults) {
+      dirs->insert(dirs->end(), std::make_move_iterator(threadDirs.begin()),
+                   std::make_move_iterator(threadDirs.end()));
+    }
+  }
+
+  std::vector<WalkedFile> merged;
+  for (auto &threadResults : results) {
+    merged.insert(merged.end(), std::make_move_iterator(threadResults.begin()),
+                  std::make_move_iterator(threadResults.end()));
+  }
+  std::sort(merged.begin(), merged.end(),
+            [](const WalkedFile &a, const WalkedFile &b) {
+              return a.path < b.path;
+            });
+  return merged;
+}
+
+} // namespace AN
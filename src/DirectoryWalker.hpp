@@ -0,0 +1,54 @@
+#pragma once
+#include "Fingerprint.hpp"
+#include <atomic>
+#include <deque>
+#include <filesystem>
+#include <functional>
+#include <mutex>
+#include <string_view>
+#include <vector>
+
+namespace AN {
+namespace fs = std::filesystem;
+
+struct WalkedFile {
+  fs::path path;
+  FileFingerprint fingerprint;
+};
+
+struct WalkedDir {
+  fs::path path;
+  // from just before it was listed, mtimeNs 0 if it couldn't be in full
+  DirStamp stamp;
+};
+
+// recursive folder walk spread over a pool of threads. Each thread works
+// depth first off its own queue of folders, and steals from the front of the
+// others' queues when it runs dry, so one huge subtree still gets shared out.
+// With nothing to steal it sleeps until another thread queues a folder.
+// Mostly pays off where readdir+stat latency dominates eg network shares
+class DirectoryWalker {
+public:
+  // threadCount 0 is treated as 1
+  explicit DirectoryWalker(unsigned threadCount);
+
+  // every non-folder entry under root whose name accept() lets through,
+  // sorted by path so the result doesn't depend on thread timing. accept is
+  // called concurrently. Every folder found (root included) goes in dirs if
+  // given, in no particular order. Once stop is set no more folders are
+  // listed, and what was found so far comes back
+  std::vector<WalkedFile> walk(const fs::path &root,
+                               std::function<bool(std::string_view)> accept,
+                               std::vector<WalkedDir> *dirs = nullptr,
+                               const std::atomic<bool> *stop = nullptr);
+
+private:
+  struct WorkQueue {
+    std::mutex mutex;
+    std::deque<fs::path> dirs;
+  };
+
+  unsigned m_threadCount;
+};
+
+} // namespace AN
@@ -0,0 +1,111 @@
+#include "EventQueue.hpp"
+
+#include <algorithm>
+#include <bit>
+#include <cerrno>
+#include <cstdint>
+#include <cstring>
+#include <fcntl.h>
+#include <iostream>
+#include <poll.h>
+#include <stdexcept>
+#include <unistd.h>
+
+namespace AN {
+
+EventQueue::EventQueue(size_t capacity) {
+  size_t size = std::bit_ceil(std::max<size_t>(capacity, 2));
+  m_slots = std::make_unique<Slot[]>(size);
+  m_mask = size - 1;
+  for (size_t i = 0; i < size; ++i) {
+    m_slots[i].sequence.store(i, std::memory_order_relaxed);
+  }
+
+  // no pipe2 on macOS
+  if (pipe(m_wakePipe) == -1) {
+    throw std::runtime_error("pipe() error: " + std::string(strerror(errno)));
+  }
+  for (int fd : m_wakePipe) {
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+    fcntl(fd, F_SETFD, FD_CLOEXEC);
+  }
+}
+
+EventQueue::~EventQueue() {
+  close(m_wakePipe[0]);
+  close(m_wakePipe[1]);
+}
+
+bool EventQueue::push(FileEvent event) {
+  size_t pos = m_enqueuePos.load(std::memory_order_relaxed);
+  Slot *slot;
+  while (true) {
+    slot = &m_slots[pos & m_mask];
+    size_t sequence = slot->sequence.load(std::memory_order_acquire);
+    intptr_t diff = static_cast<intptr_t>(sequence) - static_cast<intptr_t>(pos);
+    if (diff == 0) {
+      // slot is free for pos, claim it
+      if (m_enqueuePos.compare_exchange_weak(pos, pos + 1,
+                                             std::memory_order_relaxed))
+        break;
+    } else if (diff < 0) {
+      // consumer hasn't freed it from the last lap yet, full
+      m_overflowed.store(true, std::memory_order_release);
+      return false;
+    } else {
+      // another producer got here first
+      pos = m_enqueuePos.load(std::memory_order_relaxed);
+    }
+  }
+  slot->event = std::move(event);
+  // publish to the consumer
+  slot->sequence.store(pos + 1, std::memory_order_release);
+  return true;
+}
+
+void EventQueue::notify() {
+  // only the first notify since the consumer last woke needs a syscall
+  if (m_wakePending.exchange(true, std::memory_order_acq_rel))
+    return;
+  char byte = 0;
+  if (write(m_wakePipe[1], &byte, 1) == -1 && errno != EAGAIN) {
+    std::cerr << "Failed to wake event consumer: " << strerror(errno) << "\n";
+  }
+}
+
+size_t EventQueue::drain(std::vector<FileEvent> &out, size_t max) {
+  size_t count = 0;
+  while (count < max) {
+    Slot &slot = m_slots[m_dequeuePos & m_mask];
+    size_t sequence = slot.sequence.load(std::memory_order_acquire);
+    // not published yet, either empty or a producer is mid push
+    if (sequence != m_dequeuePos + 1)
+      break;
+    out.push_back(std::move(slot.event));
+    // free for the producers' next lap
+    slot.sequence.store(m_dequeuePos + m_mask + 1, std::memory_order_release);
+    ++m_dequeuePos;
+    ++count;
+  }
+  return count;
+}
+
+bool EventQueue::takeOverflowed() {
+  return m_overflowed.exchange(false, std::memory_order_acq_rel);
+}
+
+void EventQueue::wait(int timeoutMs) {
+  struct pollfd pollFd{m_wakePipe[0], POLLIN, 0};
+  if (poll(&pollFd, 1, timeoutMs) == -1 && errno != EINTR) {
+    std::cerr << "poll() error waiting for events: " << strerror(errno)
+              << "\n";
+  }
+  char buffer[64];
+  while (read(m_wakePipe[0], buffer, sizeof(buffer)) > 0) {
+  }
+  // read modify write so it synchronises with the producer's exchange, and
+  // everything pushed before that notify is visible to the next drain
+  m_wakePending.exchange(false, std::memory_order_acq_rel);
+}
+
+} // namespace AN
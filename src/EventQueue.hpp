@@ -0,0 +1,55 @@
+#pragma once
+#include "EventSource.hpp"
+#include <atomic>
+#include <cstddef>
+#include <memory>
+#include <vector>
+
+namespace AN {
+
+// bounded lock free ring of FileEvents from the EventSource thread(s) to the
+// one thread scanning. Each slot carries a sequence number saying whose turn it
+// is (Vyukov's bounded queue), so producers only contend on one atomic
+// increment and never wait on the consumer. When full, push drops the event
+// and flags the overflow, the consumer then rescans everything as with a
+// kernel queue overflow. notify()/wait() is a self pipe, so the consumer can
+// sleep with a timeout without any lock on the producer side
+class EventQueue {
+public:
+  // capacity is rounded up to a power of two
+  explicit EventQueue(size_t capacity);
+  ~EventQueue();
+  EventQueue(const EventQueue &) = delete;
+  EventQueue &operator=(const EventQueue &) = delete;
+
+  // any thread. False if full and the event was dropped
+  bool push(FileEvent event);
+  // wake the consumer, call once after pushing a batch
+  void notify();
+
+  // consumer only from here. Moves up to max events onto the end of out,
+  // returns how many
+  size_t drain(std::vector<FileEvent> &out, size_t max);
+  // were any events dropped since last asked
+  bool takeOverflowed();
+  // block until notify() or timeoutMs (-1 forever), returns straight away if
+  // notified since the last wait
+  void wait(int timeoutMs);
+
+private:
+  struct Slot {
+    std::atomic<size_t> sequence;
+    FileEvent event;
+  };
+
+  std::unique_ptr<Slot[]> m_slots;
+  size_t m_mask;
+  // separate cache lines, producers hammer the first
+  alignas(64) std::atomic<size_t> m_enqueuePos{0};
+  alignas(64) size_t m_dequeuePos{0};
+  std::atomic_bool m_overflowed{false};
+  std::atomic_bool m_wakePending{false};
+  int m_wakePipe[2]{-1, -1};
+};
+
+} // namespace AN
@@ -0,0 +1,452 @@
+#include "EventSource.hpp"
+
+#include <algorithm>
+#include <array>
+#include <cerrno>
+#include <cstring>
+#include <iostream>
+#include <poll.h>
+#include <unistd.h>
+
+#ifdef __linux__
+#include <sys/eventfd.h>
+#include <sys/inotify.h>
+#endif
+
+namespace AN {
+
+std::unique_ptr<EventSource>
+makeEventSource(EventHandler handler, [[maybe_unused]] double latencySeconds) {
+#if defined(__APPLE__)
+  return std::make_unique<FSEventsSource>(std::move(handler), latencySeconds);
+#elif defined(__linux__)
+  return std::make_unique<InotifySource>(std::move(handler));
+#else
+#error "No EventSource backend for this platform"
+#endif
+}
+
+#ifdef __APPLE__
+FSEventsSource::FSEventsSource(EventHandler handler, double latencySeconds)
+    : EventSource(std::move(handler)), m_latency(latencySeconds) {
+  m_queue = dispatch_queue_create(nullptr, DISPATCH_QUEUE_SERIAL);
+}
+
+FSEventsSource::~FSEventsSource() {
+  stop();
+  dispatch_release(m_queue);
+}
+
+FSEventStreamRef FSEventsSource::createStream(const fs::path &root,
+                                              EventId sinceWhen) {
+  CFStringRef path = CFStringCreateWithCString(
+      kCFAllocatorDefault, root.c_str(), kCFStringEncodingUTF8);
+  // array owns the string
+  CFArrayRef pathRefs =
+      CFArrayCreate(nullptr, reinterpret_cast<const void **>(&path), 1,
+                    &kCFTypeArrayCallBacks);
+  CFRelease(path);
+
+  FSEventStreamContext context{0, this, nullptr, nullptr, nullptr};
+  FSEventStreamRef stream = FSEventStreamCreate(
+      nullptr, &callback, &context, pathRefs, sinceWhen, m_latency,
+      kFSEventStreamCreateFlagNone);
+  CFRelease(pathRefs);
+  if (!stream)
+    return nullptr;
+
+  FSEventStreamSetDispatchQueue(stream, m_queue);
+  if (!FSEventStreamStart(stream)) {
+    FSEventStreamInvalidate(stream);
+    FSEventStreamRelease(stream);
+    return nullptr;
+  }
+  return stream;
+}
+
+static void releaseStream(FSEventStreamRef stream) {
+  // hand over whatever's held back for latency first, so the latest id
+  // covers everything up to now
+  FSEventStreamFlushSync(stream);
+  FSEventStreamStop(stream);
+  FSEventStreamInvalidate(stream);
+  FSEventStreamRelease(stream);
+}
+
+bool FSEventsSource::start(std::span<const fs::path> roots,
+                           EventId sinceWhen) {
+  stop();
+
+  m_latestEventId = sinceWhen == EventIdSinceNow ? FSEventsGetCurrentEventId()
+                                                 : sinceWhen;
+  std::lock_guard<std::mutex> lock(m_streamsMutex);
+  for (const auto &root : roots) {
+    FSEventStreamRef stream = createStream(root, sinceWhen);
+    if (!stream) {
+      for (const auto &[streamRoot, started] : m_streams) {
+        releaseStream(started);
+      }
+      m_streams.clear();
+      return false;
+    }
+    m_streams.emplace(root, stream);
+  }
+  m_isRunning.store(true);
+  return true;
+}
+
+void FSEventsSource::stop() {
+  if (!m_isRunning.exchange(false)) {
+    // has not yet been set up
+    return;
+  }
+  std::lock_guard<std::mutex> lock(m_streamsMutex);
+  for (const auto &[root, stream] : m_streams) {
+    releaseStream(stream);
+  }
+  m_streams.clear();
+}
+
+bool FSEventsSource::addRoot(const fs::path &root) {
+  if (!m_isRunning.load())
+    return false;
+  std::lock_guard<std::mutex> lock(m_streamsMutex);
+  if (m_streams.contains(root))
+    return true;
+  FSEventStreamRef stream = createStream(root, kFSEventStreamEventIdSinceNow);
+  if (!stream)
+    return false;
+  m_streams.emplace(root, stream);
+  return true;
+}
+
+void FSEventsSource::removeRoot(const fs::path &root) {
+  std::lock_guard<std::mutex> lock(m_streamsMutex);
+  auto it = m_streams.find(root);
+  if (it == m_streams.end())
+    return;
+  releaseStream(it->second);
+  m_streams.erase(it);
+}
+
+void FSEventsSource::callback(ConstFSEventStreamRef stream, void *callbackInfo,
+                              size_t numEvents, void *evPaths,
+                              const FSEventStreamEventFlags evFlags[],
+                              const FSEventStreamEventId evIds[]) {
+  auto *self = static_cast<FSEventsSource *>(callbackInfo);
+  // without kFSEventStreamCreateFlagUseCFTypes paths are plain c strings
+  char **paths = static_cast<char **>(evPaths);
+
+  std::vector<FileEvent> events;
+  events.reserve(numEvents);
+  for (size_t i = 0; i < numEvents; ++i) {
+    FileEvent event{paths[i], EventNone, evIds[i]};
+    FSEventStreamEventFlags flags = evFlags[i];
+    if (flags & (kFSEventStreamEventFlagMustScanSubDirs |
+                 kFSEventStreamEventFlagRootChanged))
+      event.flags |= EventMustRescan;
+    if (flags & kFSEventStreamEventFlagItemCreated)
+      event.flags |= EventCreated;
+    if (flags & kFSEventStreamEventFlagItemRemoved)
+      event.flags |= EventRemoved;
+    if (flags & (kFSEventStreamEventFlagItemModified |
+                 kFSEventStreamEventFlagItemInodeMetaMod))
+      event.flags |= EventModified;
+    if (flags & kFSEventStreamEventFlagItemRenamed)
+      event.flags |= EventRenamed;
+    // not using file level events, so anything else is the containing folder
+    if (!(flags & kFSEventStreamEventFlagItemIsFile))
+      event.flags |= EventIsDir;
+    events.push_back(std::move(event));
+    // history done/root changed notices come with id 0
+    if (evIds[i] != 0 && evIds[i] > self->m_latestEventId.load())
+      self->m_latestEventId.store(evIds[i]);
+  }
+  self->m_handler(events);
+}
+#endif
+
+#ifdef __linux__
+// IN_ONLYDIR since we only ever watch folders, files are reported through them
+constexpr uint32_t WatchMask = IN_CREATE | IN_DELETE | IN_MODIFY |
+                               IN_CLOSE_WRITE | IN_MOVED_FROM | IN_MOVED_TO |
+                               IN_DELETE_SELF | IN_MOVE_SELF | IN_ONLYDIR;
+
+// is path dir itself or somewhere under it
+static bool isSameOrUnder(const fs::path &dir, const fs::path &path) {
+  auto [dirIt, pathIt] =
+      std::mismatch(dir.begin(), dir.end(), path.begin(), path.end());
+  return dirIt == dir.end();
+}
+
+InotifySource::InotifySource(EventHandler handler)
+    : EventSource(std::move(handler)) {}
+
+InotifySource::~InotifySource() { stop(); }
+
+bool InotifySource::start(std::span<const fs::path> roots,
+                          [[maybe_unused]] EventId sinceWhen) {
+  // inotify can't replay anything from before it started, so sinceWhen is
+  // ignored here and the scanners' startup scan covers that gap
+  stop();
+
+  m_inotifyFd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+  if (m_inotifyFd == -1) {
+    std::cerr << "inotify_init1() error: " << strerror(errno) << "\n";
+    return false;
+  }
+  m_wakeFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+  if (m_wakeFd == -1) {
+    std::cerr << "eventfd() error: " << strerror(errno) << "\n";
+    close(m_inotifyFd);
+    m_inotifyFd = -1;
+    return false;
+  }
+
+  m_roots.assign(roots.begin(), roots.end());
+  for (const auto &root : m_roots) {
+    if (!addWatchRecursive(root, m_watches)) {
+      std::cerr << "Warning: not all folders under " << root
+                << " could be watched\n";
+    }
+  }
+
+  m_isRunning.store(true);
+  m_readThread = std::thread(&InotifySource::readLoop, this);
+  return true;
+}
+
+void InotifySource::stop() {
+  if (!m_isRunning.exchange(false))
+    return;
+
+  // wake the read thread up out of poll()
+  uint64_t one = 1;
+  if (write(m_wakeFd, &one, sizeof(one)) == -1) {
+    std::cerr << "Failed to wake inotify thread: " << strerror(errno) << "\n";
+  }
+  m_readThread.join();
+
+  close(m_inotifyFd);
+  close(m_wakeFd);
+  m_inotifyFd = -1;
+  m_wakeFd = -1;
+  m_watches.clear();
+  std::lock_guard<std::mutex> lock(m_rootsMutex);
+  m_roots.clear();
+  m_addedWatches.clear();
+  m_removedRoots.clear();
+}
+
+bool InotifySource::addRoot(const fs::path &root) {
+  if (!m_isRunning.load())
+    return false;
+  // the slow part for a big tree, done here rather than holding up the read
+  // thread. Events from the new watches before it takes them in are lost,
+  // the scan that follows covers them
+  Watches watches;
+  if (!addWatchRecursive(root, watches)) {
+    std::cerr << "Warning: not all folders under " << root
+              << " could be watched\n";
+  }
+  std::lock_guard<std::mutex> lock(m_rootsMutex);
+  if (std::find(m_roots.begin(), m_roots.end(), root) == m_roots.end())
+    m_roots.push_back(root);
+  for (auto &[wd, path] : watches) {
+    m_addedWatches.insert_or_assign(wd, std::move(path));
+  }
+  return true;
+}
+
+void InotifySource::removeRoot(const fs::path &root) {
+  {
+    std::lock_guard<std::mutex> lock(m_rootsMutex);
+    auto it = std::find(m_roots.begin(), m_roots.end(), root);
+    if (it == m_roots.end())
+      return;
+    m_roots.erase(it);
+    m_removedRoots.push_back(root);
+  }
+  // so its watches go now rather than with the next event
+  uint64_t one = 1;
+  if (write(m_wakeFd, &one, sizeof(one)) == -1) {
+    std::cerr << "Failed to wake inotify thread: " << strerror(errno) << "\n";
+  }
+}
+
+void InotifySource::applyRootChanges() {
+  std::lock_guard<std::mutex> lock(m_rootsMutex);
+  for (auto &[wd, path] : m_addedWatches) {
+    m_watches.insert_or_assign(wd, std::move(path));
+  }
+  m_addedWatches.clear();
+  // a root removed then added again before we got here is in m_roots, and
+  // keeps its watches
+  for (const auto &root : m_removedRoots) {
+    removeWatchRecursive(root, m_roots);
+  }
+  m_removedRoots.clear();
+}
+
+bool InotifySource::addWatchRecursive(const fs::path &dir, Watches &watches) {
+  bool allAdded = true;
+  auto addWatch = [&](const fs::path &path) {
+    // re-adding an already watched inode (eg moved folder) returns the same wd,
+    // so this also updates the stored path
+    int wd = inotify_add_watch(m_inotifyFd, path.c_str(), WatchMask);
+    if (wd == -1) {
+      // gone again before we got to it, the scan will notice
+      if (errno == ENOENT || errno == ENOTDIR)
+        return;
+      std::cerr << "inotify_add_watch() error at " << path << ": "
+                << strerror(errno) << "\n";
+      allAdded = false;
+      return;
+    }
+    watches[wd] = path;
+  };
+
+  addWatch(dir);
+  std::error_code ec;
+  for (auto it = fs::recursive_directory_iterator(
+           dir, fs::directory_options::skip_permission_denied, ec);
+       !ec && it != fs::recursive_directory_iterator(); it.increment(ec)) {
+    if (it->is_directory(ec) && !it->is_symlink(ec))
+      addWatch(it->path());
+  }
+  return allAdded;
+}
+
+void InotifySource::removeWatchRecursive(const fs::path &dir,
+                                         std::span<const fs::path> keepRoots) {
+  std::erase_if(m_watches, [&](const auto &watch) {
+    if (!isSameOrUnder(dir, watch.second))
+      return false;
+    for (const auto &root : keepRoots) {
+      if (isSameOrUnder(root, watch.second))
+        return false;
+    }
+    inotify_rm_watch(m_inotifyFd, watch.first);
+    return true;
+  });
+}
+
+void InotifySource::readLoop() {
+  alignas(struct inotify_event) char buffer[64 * 1024];
+  std::array<struct pollfd, 2> pollFds;
+  pollFds[0].fd = m_inotifyFd;
+  pollFds[0].events = POLLIN;
+  pollFds[1].fd = m_wakeFd;
+  pollFds[1].events = POLLIN;
+
+  while (m_isRunning.load()) {
+    if (poll(pollFds.data(), pollFds.size(), -1) == -1) {
+      if (errno == EINTR)
+        continue;
+      std::cerr << "poll() error in inotify loop: " << strerror(errno) << "\n";
+      break;
+    }
+    if (pollFds[1].revents & POLLIN) {
+      if (!m_isRunning.load())
+        break; // stop() called
+      uint64_t count;
+      if (read(m_wakeFd, &count, sizeof(count)) == -1 && errno != EAGAIN) {
+        std::cerr << "read() error on eventfd: " << strerror(errno) << "\n";
+      }
+    }
+    // before reading, so an added root's events find their watches
+    applyRootChanges();
+    if (!(pollFds[0].revents & POLLIN))
+      continue;
+
+    std::vector<FileEvent> events;
+    ssize_t len;
+    // fd is nonblocking so this drains everything queued then gets EAGAIN
+    while ((len = read(m_inotifyFd, buffer, sizeof(buffer))) > 0) {
+      const struct inotify_event *event;
+      for (char *ptr = buffer; ptr < buffer + len;
+           ptr += sizeof(struct inotify_event) + event->len) {
+        event = reinterpret_cast<const struct inotify_event *>(ptr);
+        EventId id = ++m_latestEventId;
+
+        if (event->mask & IN_Q_OVERFLOW) {
+          // kernel queue overflowed and events were lost, fall back to
+          // rescanning everything. Folders created meanwhile lost their
+          // IN_CREATE too, so watch them first or nothing in them is ever
+          // seen. Already watched ones just get the same wd back
+          std::vector<fs::path> roots;
+          {
+            std::lock_guard<std::mutex> lock(m_rootsMutex);
+            roots = m_roots;
+          }
+          for (const auto &root : roots) {
+            addWatchRecursive(root, m_watches);
+            events.push_back({root, EventMustRescan | EventIsDir, id});
+          }
+          continue;
+        }
+
+        auto watch = m_watches.find(event->wd);
+        if (watch == m_watches.end())
+          continue;
+        if (event->mask & IN_IGNORED) {
+          // watch removed, either by us or because the folder went away
+          m_watches.erase(watch);
+          continue;
+        }
+
+        const fs::path &dir = watch->second;
+        if (event->mask & IN_DELETE_SELF) {
+          // subfolders are already reported by their parent, matters for roots
+          events.push_back({dir, EventRemoved | EventIsDir, id});
+          continue;
+        }
+        if (event->mask & IN_MOVE_SELF) {
+          // likewise, but only a root's is worth anything. A moved subfolder
+          // had its path updated by the IN_MOVED_TO before this arrives
+          std::lock_guard<std::mutex> lock(m_rootsMutex);
+          if (std::find(m_roots.begin(), m_roots.end(), dir) != m_roots.end())
+            events.push_back({dir, EventRemoved | EventIsDir, id});
+          continue;
+        }
+
+        fs::path path = event->len ? dir / event->name : dir;
+        uint32_t flags = EventNone;
+        if (event->mask & IN_ISDIR)
+          flags |= EventIsDir;
+        if (event->mask & IN_CREATE)
+          flags |= EventCreated;
+        if (event->mask & IN_DELETE)
+          flags |= EventRemoved;
+        if (event->mask & (IN_MODIFY | IN_CLOSE_WRITE))
+          flags |= EventModified;
+        if (event->mask & IN_CLOSE_WRITE)
+          flags |= EventClosed;
+        if (event->mask & IN_MOVED_FROM)
+          flags |= EventRemoved | EventRenamed;
+        if (event->mask & IN_MOVED_TO)
+          flags |= EventCreated | EventRenamed;
+
+        if (event->mask & IN_ISDIR) {
+          // new subfolders need their own watches. Anything written into them
+          // before the watch was added gets picked up when this event's folder
+          // is scanned
+          if (event->mask & (IN_CREATE | IN_MOVED_TO))
+            addWatchRecursive(path, m_watches);
+          else if (event->mask & IN_MOVED_FROM)
+            removeWatchRecursive(path);
+        }
+        events.push_back({std::move(path), flags, id});
+      }
+    }
+    if (len == -1 && errno != EAGAIN && errno != EINTR) {
+      std::cerr << "read() error on inotify fd: " << strerror(errno) << "\n";
+    }
+
+    if (!events.empty())
+      m_handler(events);
+  }
+}
+#endif
+
+} // namespace AN
@@ -0,0 +1,162 @@
+#pragma once
+#include <atomic>
+#include <cstdint>
+#include <filesystem>
+#include <functional>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <span>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+#ifdef __APPLE__
+#include <CoreServices/CoreServices.h>
+#endif
+
+namespace AN {
+namespace fs = std::filesystem;
+
+// platform independent stand in for FSEventStreamEventId. On linux inotify has
+// no persistent ids so this is just a counter for the current run
+using EventId = uint64_t;
+// same value as kFSEventStreamEventIdSinceNow, ie don't replay history
+constexpr EventId EventIdSinceNow = UINT64_MAX;
+
+enum EventFlags : uint32_t {
+  EventNone = 0,
+  EventCreated = 1 << 0,
+  EventRemoved = 1 << 1,
+  EventModified = 1 << 2,
+  EventRenamed = 1 << 3,
+  EventIsDir = 1 << 4,
+  // backend dropped events (queue overflow etc), rescan everything under path
+  EventMustRescan = 1 << 5,
+  // a writer closed the file, so it's probably complete. inotify only
+  EventClosed = 1 << 6,
+};
+
+struct FileEvent {
+  fs::path path;
+  uint32_t flags{EventNone};
+  EventId id{0};
+};
+
+// called from the backend's own thread/queue with each batch of events, so
+// must be thread safe wrt whoever consumes them
+using EventHandler = std::function<void(std::span<const FileEvent>)>;
+
+// watches a set of root folders recursively and reports changes under them.
+// FSEvents on macOS, inotify on linux
+class EventSource {
+public:
+  explicit EventSource(EventHandler handler) : m_handler(std::move(handler)) {}
+  virtual ~EventSource() {};
+
+  // begin watching roots, replaying from sinceWhen where supported. Restarts if
+  // already running
+  virtual bool start(std::span<const fs::path> roots, EventId sinceWhen) = 0;
+  virtual void stop() = 0;
+  // watch one more root, or stop watching one, while running and without
+  // disturbing the others. Any thread. Nothing is replayed for an added root,
+  // whoever adds it scans it after
+  virtual bool addRoot(const fs::path &root) = 0;
+  virtual void removeRoot(const fs::path &root) = 0;
+  virtual bool isRunning() const = 0;
+  virtual EventId getLatestEventId() = 0;
+  // whether start() can replay from a getLatestEventId() saved by an earlier
+  // run, ie whoever restarts needn't rescan for what changed meanwhile
+  virtual bool canReplay() const = 0;
+
+protected:
+  EventHandler m_handler;
+};
+
+// pick the right backend for this platform. latencySeconds is how long
+// FSEvents holds events back to coalesce them, inotify reports straight away
+std::unique_ptr<EventSource> makeEventSource(EventHandler handler,
+                                             double latencySeconds);
+
+#ifdef __APPLE__
+class FSEventsSource : public EventSource {
+public:
+  FSEventsSource(EventHandler handler, double latencySeconds);
+  ~FSEventsSource();
+
+  bool start(std::span<const fs::path> roots, EventId sinceWhen) override;
+  void stop() override;
+  bool addRoot(const fs::path &root) override;
+  void removeRoot(const fs::path &root) override;
+  bool isRunning() const override { return m_isRunning.load(); }
+  EventId getLatestEventId() override { return m_latestEventId.load(); }
+  bool canReplay() const override { return true; }
+
+private:
+  // a stream per root, so one can come or go without touching the rest. All
+  // deliver on m_queue, so the handler still sees one batch at a time
+  std::mutex m_streamsMutex; // m_streams
+  std::map<fs::path, FSEventStreamRef> m_streams;
+  dispatch_queue_t m_queue{nullptr};
+  CFAbsoluteTime m_latency;
+  std::atomic_bool m_isRunning{false};
+  // highest id delivered by any stream
+  std::atomic<EventId> m_latestEventId{EventIdSinceNow};
+
+  // started on m_queue, nullptr if FSEvents refused
+  FSEventStreamRef createStream(const fs::path &root, EventId sinceWhen);
+
+  static void callback(ConstFSEventStreamRef stream, void *callbackInfo,
+                       size_t numEvents, void *evPaths,
+                       const FSEventStreamEventFlags evFlags[],
+                       const FSEventStreamEventId evIds[]);
+};
+#endif
+
+#ifdef __linux__
+class InotifySource : public EventSource {
+public:
+  explicit InotifySource(EventHandler handler);
+  ~InotifySource();
+
+  bool start(std::span<const fs::path> roots, EventId sinceWhen) override;
+  void stop() override;
+  bool addRoot(const fs::path &root) override;
+  void removeRoot(const fs::path &root) override;
+  bool isRunning() const override { return m_isRunning.load(); }
+  EventId getLatestEventId() override { return m_latestEventId.load(); }
+  bool canReplay() const override { return false; }
+
+private:
+  using Watches = std::unordered_map<int, fs::path>;
+
+  int m_inotifyFd{-1};
+  int m_wakeFd{-1}; // eventfd, written to break the read loop out of poll()
+  std::atomic_bool m_isRunning{false};
+  std::atomic<EventId> m_latestEventId{0};
+  std::thread m_readThread{};
+  std::mutex m_rootsMutex; // everything below bar m_watches
+  std::vector<fs::path> m_roots;
+  // added/removed roots for m_readThread to catch up with. The watches for
+  // added ones are already in place, set up by whoever added them so the
+  // read thread can keep on reading the other roots' events meanwhile
+  Watches m_addedWatches;
+  std::vector<fs::path> m_removedRoots;
+  // watch descriptor -> directory it watches. Only touched by m_readThread
+  // once started
+  Watches m_watches;
+
+  // add watches for dir and everything under it to watches, returns false if
+  // the kernel refused any (eg out of max_user_watches)
+  bool addWatchRecursive(const fs::path &dir, Watches &watches);
+  // drop watches for dir and everything under it, bar any still under one
+  // of keepRoots
+  void removeWatchRecursive(const fs::path &dir,
+                            std::span<const fs::path> keepRoots = {});
+  // read thread, take in the added/removed roots
+  void applyRootChanges();
+  void readLoop();
+};
+#endif
+
+} // namespace AN
@@ -0,0 +1,234 @@
+#include "ExecutorPool.hpp"
+
+#include <algorithm>
+#include <cstring>
+#include <iostream>
+#include <unistd.h>
+
+extern char **environ;
+
+namespace AN {
+
+// left over for whatever the kernel/libc add to the stack alongside argv
+constexpr size_t ArgSpaceHeadroom = 4096;
+
+size_t getArgSpaceLimit() {
+  // environment doesn't change after startup, so neither does this
+  static const size_t limit = []() {
+    long argMax = sysconf(_SC_ARG_MAX);
+    // unknown, POSIX guarantees at least this much
+    size_t space = argMax > 0 ? static_cast<size_t>(argMax) : _POSIX_ARG_MAX;
+    size_t environment = sizeof(char *); // terminating nullptr
+    for (char **var = environ; var && *var; ++var) {
+      environment += strlen(*var) + 1 + sizeof(char *);
+    }
+    size_t used = environment + ArgSpaceHeadroom;
+    return space > used ? space - used : 0;
+  }();
+  return limit;
+}
+
+std::vector<std::vector<fs::path>> chunkFileList(std::vector<fs::path> files,
+                                                 const fs::path &cmd,
+                                                 size_t maxFiles,
+                                                 size_t maxBytes) {
+  size_t limit = getArgSpaceLimit();
+  if (maxBytes > 0)
+    limit = std::min(limit, maxBytes);
+  // argv[0] and the terminating nullptr come with every cmd
+  const size_t baseBytes = cmd.native().size() + 1 + 2 * sizeof(char *);
+
+  std::vector<std::vector<fs::path>> chunks;
+  size_t chunkBytes = 0;
+  for (fs::path &file : files) {
+    size_t fileBytes = file.native().size() + 1 + sizeof(char *);
+    bool isFull = !chunks.empty() &&
+                  ((maxFiles > 0 && chunks.back().size() >= maxFiles) ||
+                   chunkBytes + fileBytes > limit);
+    if (chunks.empty() || isFull) {
+      chunks.emplace_back();
+      chunkBytes = baseBytes;
+    }
+    chunks.back().push_back(std::move(file));
+    chunkBytes += fileBytes;
+  }
+  return chunks;
+}
+
+// processed originals that aren't being kept
+static void removeFiles(std::span<const fs::path> files) {
+  for (const fs::path &file : files) {
+    std::error_code ec;
+    if (!fs::remove(file, ec) && ec) {
+      std::cerr << "Failed to remove " << file << ": " << ec.message()
+                << "\n";
+    }
+  }
+}
+
+ProcessResult fileListExecutor(const fs::path &command,
+                               std::span<const fs::path> filenames, bool keep,
+                               std::chrono::seconds timeout) {
+  std::vector<std::string> args;
+  args.reserve(filenames.size());
+  for (const fs::path &file : filenames) {
+    args.push_back(file.string());
+  }
+
+  ProcessResult result = runProcess(command, args, timeout);
+  // pass the command's output on to our own log
+  if (!result.out.empty())
+    std::cout << result.out;
+  if (!result.err.empty())
+    std::cerr << result.err;
+  if (!result.succeeded()) {
+    std::cerr << "Error: " << command << " on " << filenames.size()
+              << " files " << result.describe() << "\n";
+    // leave the originals be so nothing is lost
+    return result;
+  }
+
+  // finished, delete original file if requested
+  if (!keep)
+    removeFiles(filenames);
+  return result;
+}
+
+ExecutorPool::ExecutorPool(unsigned threadCount, size_t queueCapacity,
+                           ProcessingLedger *ledger)
+    : m_queueCapacity(std::max<size_t>(queueCapacity, 1)), m_ledger(ledger) {
+  for (unsigned i = 0; i < std::max(threadCount, 1u); ++i) {
+    m_threads.emplace_back(&ExecutorPool::workerLoop, this);
+  }
+}
+
+ExecutorPool::~ExecutorPool() { stop(); }
+
+bool ExecutorPool::submit(ExecutorJob job) {
+  std::unique_lock<std::mutex> lock(m_mutex);
+  // backpressure: hold the caller (scanner) here until there's room
+  m_queueSpaceCV.wait(lock, [this]() {
+    return m_isStopping || m_queue.size() < m_queueCapacity;
+  });
+  if (m_isStopping)
+    return false;
+
+  m_queue.push_back(std::move(job));
+  lock.unlock();
+  m_jobReadyCV.notify_one();
+  return true;
+}
+
+void ExecutorPool::stop() {
+  {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    if (m_isStopping)
+      return;
+    m_isStopping = true;
+    if (!m_queue.empty()) {
+      std::cerr << "Executor stopping, dropping " << m_queue.size()
+                << " queued jobs\n";
+    }
+    m_queue.clear();
+  }
+  m_jobReadyCV.notify_all();
+  m_queueSpaceCV.notify_all();
+  for (auto &thread : m_threads) {
+    thread.join();
+  }
+  // EOF on their stdin, they finish up and exit
+  m_idleCoProcesses.clear();
+}
+
+std::deque<ExecutorJob>::iterator ExecutorPool::findRunnableJob() {
+  return std::find_if(m_queue.begin(), m_queue.end(), [this](auto &job) {
+    auto running = m_runningPerExtension.find(job.settings.extension);
+    return running == m_runningPerExtension.end() ||
+           running->second < std::max(job.settings.maxConcurrency, 1u);
+  });
+}
+
+void ExecutorPool::streamJob(const ExecutorJob &job,
+                             std::unique_ptr<CoProcess> &coProcess) {
+  if (!coProcess)
+    coProcess = std::make_unique<CoProcess>(job.settings.cmd);
+  // the per file cost should be a pipe write, so the ledger (which flushes)
+  // hears about the whole job at once, apart from failures
+  if (m_ledger)
+    m_ledger->started(job.files);
+  std::vector<fs::path> succeeded;
+  for (const fs::path &file : job.files) {
+    ProcessResult result = coProcess->process(
+        file, std::chrono::seconds(job.settings.timeoutSeconds));
+    std::span<const fs::path> one(&file, 1);
+    if (result.succeeded()) {
+      if (!job.settings.keep)
+        removeFiles(one);
+      succeeded.push_back(file);
+      continue;
+    }
+    std::cerr << "Error: " << job.settings.cmd << " on " << file << " "
+              << result.describe() << "\n";
+    if (m_ledger)
+      m_ledger->finished(one, false, result.describe());
+  }
+  if (m_ledger && !succeeded.empty())
+    m_ledger->finished(succeeded, true);
+}
+
+void ExecutorPool::workerLoop() {
+  while (true) {
+    std::unique_lock<std::mutex> lock(m_mutex);
+    std::deque<ExecutorJob>::iterator found;
+    m_jobReadyCV.wait(lock, [&]() {
+      if (m_isStopping)
+        return true;
+      found = findRunnableJob();
+      return found != m_queue.end();
+    });
+    if (m_isStopping)
+      return;
+
+    ExecutorJob job = std::move(*found);
+    m_queue.erase(found);
+    const std::string extension = job.settings.extension;
+    ++m_runningPerExtension[extension];
+    std::unique_ptr<CoProcess> coProcess;
+    if (job.settings.stream) {
+      auto &idle = m_idleCoProcesses[extension];
+      if (!idle.empty()) {
+        coProcess = std::move(idle.back());
+        idle.pop_back();
+      }
+    }
+    lock.unlock();
+    m_queueSpaceCV.notify_one();
+
+    if (job.settings.stream) {
+      streamJob(job, coProcess);
+    } else {
+      if (m_ledger)
+        m_ledger->started(job.files);
+      ProcessResult result =
+          fileListExecutor(job.settings.cmd, job.files, job.settings.keep,
+                           std::chrono::seconds(job.settings.timeoutSeconds));
+      if (m_ledger)
+        m_ledger->finished(job.files, result.succeeded(), result.describe());
+    }
+
+    lock.lock();
+    --m_runningPerExtension[extension];
+    if (coProcess) {
+      auto &idle = m_idleCoProcesses[extension];
+      // else the limit went down since it started, and it stops as it goes
+      // out of scope
+      if (idle.size() < std::max(job.settings.maxConcurrency, 1u))
+        idle.push_back(std::move(coProcess));
+    }
+    lock.unlock();
+    // a job held back by the per extension limit may be runnable now
+    m_jobReadyCV.notify_all();
+  }
+}
+
+} // namespace AN
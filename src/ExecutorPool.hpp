@@ -0,0 +1,92 @@
+#pragma once
+#include "FoldersManager.hpp"
+#include "Process.hpp"
+#include "ProcessingLedger.hpp"
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <filesystem>
+#include <memory>
+#include <mutex>
+#include <span>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+namespace AN {
+namespace fs = std::filesystem;
+
+// run command once with all filenames as arguments, blocking until it exits
+// or runs past timeout (0 for none). Deletes the files afterwards unless keep
+// or the command failed
+ProcessResult fileListExecutor(const fs::path &command,
+                               std::span<const fs::path> filenames, bool keep,
+                               std::chrono::seconds timeout);
+
+// bytes of argv a spawned cmd can have: ARG_MAX less our environment, which
+// is passed on and counts against the same limit, and some headroom
+size_t getArgSpaceLimit();
+// split files into batches for one cmd each, in order: no more than maxFiles
+// (0 any) and with argv no bigger than maxBytes (0 or past the system limit
+// for getArgSpaceLimit()), counting cmd, each terminator and pointer as exec
+// does. A single file over the limit still gets a batch of its own, and
+// fails to spawn with E2BIG
+std::vector<std::vector<fs::path>> chunkFileList(std::vector<fs::path> files,
+                                                 const fs::path &cmd,
+                                                 size_t maxFiles,
+                                                 size_t maxBytes = 0);
+
+// one command invocation, for a single file or a whole batch depending on the
+// FileSettings. Streamed a file at a time if settings.stream
+struct ExecutorJob {
+  FileSettings settings;
+  std::vector<fs::path> files;
+};
+
+// fixed set of threads running ExecutorJobs off a bounded queue. submit()
+// blocks while the queue is full, which slows the scanner down to whatever
+// rate the commands can keep up with. No more than settings.maxConcurrency
+// jobs of the same extension run at once, others wait their turn while jobs
+// of other extensions go ahead
+class ExecutorPool {
+public:
+  // ledger (optional) is told when each job's files start and finish
+  ExecutorPool(unsigned threadCount, size_t queueCapacity,
+               ProcessingLedger *ledger = nullptr);
+  ~ExecutorPool();
+
+  // false if the pool is stopping and the job was dropped
+  bool submit(ExecutorJob job);
+  // let running jobs finish, drop the queued ones
+  void stop();
+
+private:
+  std::vector<std::thread> m_threads;
+  std::deque<ExecutorJob> m_queue;
+  size_t m_queueCapacity;
+  ProcessingLedger *m_ledger;
+  // extension -> jobs of it currently running
+  std::unordered_map<std::string, unsigned> m_runningPerExtension;
+  // extension -> started cmds of streamed types not in use by a job. Checked
+  // out for each job and back in after, so no more than maxConcurrency of
+  // them are ever up per extension
+  std::unordered_map<std::string, std::vector<std::unique_ptr<CoProcess>>>
+      m_idleCoProcesses;
+  bool m_isStopping{false};
+
+  std::mutex m_mutex;
+  std::condition_variable m_jobReadyCV;   // workers wait on
+  std::condition_variable m_queueSpaceCV; // submit waits on
+
+  void workerLoop();
+  // job through a coProcess checked out for its extension (started here if
+  // null), files reported to the ledger individually
+  void streamJob(const ExecutorJob &job,
+                 std::unique_ptr<CoProcess> &coProcess);
+  // first queued job whose extension is below its limit, or end(). m_mutex
+  // must be held
+  std::deque<ExecutorJob>::iterator findRunnableJob();
+};
+
+} // namespace AN
@@ -0,0 +1,189 @@
+#include "FileIndex.hpp"
+
+#include <algorithm>
+#include <cstring>
+#include <functional>
+
+namespace AN {
+
+constexpr size_t MinSlots = 1024;
+
+// slots kept at most 70% full
+static bool needsGrow(size_t count, size_t slots) {
+  return (count + 1) * 10 > slots * 7;
+}
+
+size_t StringPool::findSlot(std::string_view str) const {
+  size_t mask = m_slots.size() - 1;
+  size_t slot = std::hash<std::string_view>{}(str) & mask;
+  while (m_slots[slot] != 0 && m_strings[m_slots[slot] - 1] != str) {
+    slot = (slot + 1) & mask;
+  }
+  return slot;
+}
+
+void StringPool::grow() {
+  m_slots.assign(std::max(m_slots.size() * 2, MinSlots), 0);
+  for (uint32_t id = 0; id < m_strings.size(); ++id) {
+    m_slots[findSlot(m_strings[id])] = id + 1;
+  }
+}
+
+uint32_t StringPool::find(std::string_view str) const {
+  if (m_slots.empty())
+    return NotFound;
+  uint32_t slotValue = m_slots[findSlot(str)];
+  return slotValue ? slotValue - 1 : NotFound;
+}
+
+uint32_t StringPool::intern(std::string_view str) {
+  if (needsGrow(m_strings.size(), m_slots.size()))
+    grow();
+  size_t slot = findSlot(str);
+  if (m_slots[slot] != 0)
+    return m_slots[slot] - 1;
+
+  char *copy;
+  if (str.size() > BlockSize / 4) {
+    // big ones get their own block rather than wasting the rest of this one
+    m_blocks.push_back(std::make_unique<char[]>(str.size()));
+    copy = m_blocks.back().get();
+  } else {
+    // the first one too, even "" needs a real block to point into
+    if (!m_currentBlock || m_blockUsed + str.size() > BlockSize) {
+      m_blocks.push_back(std::make_unique<char[]>(BlockSize));
+      m_currentBlock = m_blocks.back().get();
+      m_blockUsed = 0;
+    }
+    copy = m_currentBlock + m_blockUsed;
+    m_blockUsed += str.size();
+  }
+  memcpy(copy, str.data(), str.size());
+
+  uint32_t id = m_strings.size();
+  m_strings.emplace_back(copy, str.size());
+  m_slots[slot] = id + 1;
+  return id;
+}
+
+FileIndex::FileIndex(fs::path root)
+    : m_root(std::move(root)), m_rootString(m_root.string()) {
+  // root itself is always dir 0
+  m_dirs.intern("");
+}
+
+std::string_view FileIndex::relativeDir(std::string_view full) const {
+  if (!full.starts_with(m_rootString))
+    return full; // not under root, keep it absolute
+  std::string_view rest = full.substr(m_rootString.size());
+  if (rest.empty() || m_rootString.back() == '/')
+    return rest;
+  if (rest.front() == '/')
+    return rest.substr(1);
+  return full; // eg /a/bc next to root /a/b
+}
+
+uint32_t FileIndex::internDir(const fs::path &dir) {
+  return m_dirs.intern(relativeDir(dir.native()));
+}
+
+uint32_t FileIndex::internDir(std::string_view dir) {
+  return m_dirs.intern(relativeDir(dir));
+}
+
+uint32_t FileIndex::findDir(const fs::path &dir) const {
+  return m_dirs.find(relativeDir(dir.native()));
+}
+
+bool FileIndex::isDirUnder(uint32_t dirId, uint32_t parentId) const {
+  std::string_view dir = m_dirs.get(dirId);
+  std::string_view parent = m_dirs.get(parentId);
+  if (dir.empty() || dir.starts_with('/'))
+    return false; // root itself, or stored absolute
+  if (parent.empty())
+    return true; // everything else is under root
+  // whole components, so a/bc isn't under a/b
+  return dir.size() > parent.size() && dir.starts_with(parent) &&
+         dir[parent.size()] == '/';
+}
+
+size_t FileIndex::findSlot(uint32_t dirId, uint32_t nameId) const {
+  size_t mask = m_slots.size() - 1;
+  uint64_t key = (static_cast<uint64_t>(dirId) << 32) | nameId;
+  key *= 0x9E3779B97F4A7C15ull; // fibonacci hashing, spreads the low bits
+  size_t slot = (key ^ (key >> 32)) & mask;
+  while (m_slots[slot] != 0) {
+    const FileRecord &record = m_records[m_slots[slot] - 1];
+    if (record.dirId == dirId && record.nameId == nameId)
+      break;
+    slot = (slot + 1) & mask;
+  }
+  return slot;
+}
+
+void FileIndex::grow() {
+  m_slots.assign(std::max(m_slots.size() * 2, MinSlots), 0);
+  for (RecordId id = 0; id < m_records.size(); ++id) {
+    m_slots[findSlot(m_records[id].dirId, m_records[id].nameId)] = id + 1;
+  }
+}
+
+FileIndex::RecordId FileIndex::find(uint32_t dirId,
+                                    std::string_view name) const {
+  uint32_t nameId = m_names.find(name);
+  if (nameId == StringPool::NotFound || m_slots.empty())
+    return NotFound;
+  uint32_t slotValue = m_slots[findSlot(dirId, nameId)];
+  return slotValue ? slotValue - 1 : NotFound;
+}
+
+FileIndex::RecordId FileIndex::find(const fs::path &file) const {
+  uint32_t dirId = m_dirs.find(relativeDir(file.parent_path().native()));
+  if (dirId == StringPool::NotFound)
+    return NotFound;
+  return find(dirId, file.filename().native());
+}
+
+std::pair<FileIndex::RecordId, bool>
+FileIndex::insert(uint32_t dirId, std::string_view name) {
+  if (needsGrow(m_records.size(), m_slots.size()))
+    grow();
+  uint32_t nameId = m_names.intern(name);
+  size_t slot = findSlot(dirId, nameId);
+  if (m_slots[slot] != 0)
+    return {m_slots[slot] - 1, false};
+
+  RecordId id = m_records.size();
+  m_records.push_back({dirId, nameId, {}, New});
+  m_slots[slot] = id + 1;
+  return {id, true};
+}
+
+std::pair<FileIndex::RecordId, bool> FileIndex::insert(const fs::path &file) {
+  return insert(internDir(file.parent_path()), file.filename().native());
+}
+
+std::pair<FileIndex::RecordId, bool>
+FileIndex::insertPath(std::string_view file) {
+  size_t slash = file.rfind('/');
+  if (slash == std::string_view::npos)
+    return insert(internDir(std::string_view()), file);
+  // keep the '/' when the file sits directly in the filesystem root
+  std::string_view dir = file.substr(0, slash == 0 ? 1 : slash);
+  return insert(internDir(dir), file.substr(slash + 1));
+}
+
+fs::path FileIndex::getDirPath(uint32_t dirId) const {
+  std::string_view dir = m_dirs.get(dirId);
+  if (dir.empty())
+    return m_root;
+  if (dir.starts_with('/'))
+    return dir; // stored absolute, wasn't under root
+  return m_root / dir;
+}
+
+fs::path FileIndex::getPath(const FileRecord &record) const {
+  return getDirPath(record.dirId) / m_names.get(record.nameId);
+}
+
+} // namespace AN
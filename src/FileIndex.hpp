@@ -0,0 +1,99 @@
+#pragma once
+#include "Fingerprint.hpp"
+#include <cstdint>
+#include <filesystem>
+#include <memory>
+#include <span>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+namespace AN {
+namespace fs = std::filesystem;
+
+// unique strings packed into big arena blocks, so millions of paths aren't a
+// heap allocation each. Ids are dense and stable, strings are never removed
+class StringPool {
+public:
+  static constexpr uint32_t NotFound = UINT32_MAX;
+
+  uint32_t intern(std::string_view str);
+  uint32_t find(std::string_view str) const; // NotFound if not interned
+  std::string_view get(uint32_t id) const { return m_strings[id]; }
+  size_t size() const { return m_strings.size(); }
+
+private:
+  static constexpr size_t BlockSize = 64 * 1024;
+  std::vector<std::unique_ptr<char[]>> m_blocks;
+  // small strings get packed in here, allocated by the first intern
+  char *m_currentBlock{nullptr};
+  size_t m_blockUsed{0};
+  std::vector<std::string_view> m_strings; // id -> view into m_blocks
+  // open addressing on the string hash, holds id + 1 so 0 is empty
+  std::vector<uint32_t> m_slots;
+
+  size_t findSlot(std::string_view str) const;
+  void grow();
+};
+
+enum FileUpdateType : uint8_t { New, Updated, Old };
+
+struct FileRecord {
+  uint32_t dirId;  // folder relative to the index root
+  uint32_t nameId; // file name within it
+  FileFingerprint fingerprint;
+  FileUpdateType state;
+};
+
+// every tracked file under one root as flat {dir, name, fingerprint, state}
+// records. Folder paths are stored once each relative to the root, file
+// names once each, and lookup is an open addressing table on the two ids
+class FileIndex {
+public:
+  using RecordId = uint32_t;
+  static constexpr RecordId NotFound = UINT32_MAX;
+
+  explicit FileIndex(fs::path root);
+
+  // id for a folder under root (or root itself), adding it if new
+  uint32_t internDir(const fs::path &dir);
+  uint32_t internDir(std::string_view dir);
+  // StringPool::NotFound if dir was never interned
+  uint32_t findDir(const fs::path &dir) const;
+  // is dirId somewhere below parentId. Folders not under root never are
+  bool isDirUnder(uint32_t dirId, uint32_t parentId) const;
+  // folder ids run from 0 (root) to dirCount() - 1
+  size_t dirCount() const { return m_dirs.size(); }
+  fs::path getDirPath(uint32_t dirId) const;
+  RecordId find(uint32_t dirId, std::string_view name) const;
+  RecordId find(const fs::path &file) const;
+  // existing or newly added record, and whether it was added
+  std::pair<RecordId, bool> insert(uint32_t dirId, std::string_view name);
+  std::pair<RecordId, bool> insert(const fs::path &file);
+  // same from a plain path string, eg a view straight into a backup file
+  std::pair<RecordId, bool> insertPath(std::string_view file);
+
+  FileRecord &operator[](RecordId id) { return m_records[id]; }
+  const FileRecord &operator[](RecordId id) const { return m_records[id]; }
+  std::span<const FileRecord> records() const { return m_records; }
+  size_t size() const { return m_records.size(); }
+
+  fs::path getPath(const FileRecord &record) const;
+  fs::path getPath(RecordId id) const { return getPath(m_records[id]); }
+
+private:
+  fs::path m_root;
+  std::string m_rootString;
+  StringPool m_dirs;
+  StringPool m_names;
+  std::vector<FileRecord> m_records;
+  // RecordId + 1 so 0 is empty
+  std::vector<uint32_t> m_slots;
+
+  // folder as stored in m_dirs, ie relative to root without leading '/'
+  std::string_view relativeDir(std::string_view dir) const;
+  size_t findSlot(uint32_t dirId, uint32_t nameId) const;
+  void grow();
+};
+
+} // namespace AN
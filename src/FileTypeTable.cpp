@@ -0,0 +1,37 @@
+#include "FileTypeTable.hpp"
+
+#include <iostream>
+
+namespace AN {
+
+FileTypeTable::FileTypeTable(std::vector<FileSettings> fileTypes) {
+  for (FileSettings &settings : fileTypes) {
+    if (m_byExtension.contains(settings.extension)) {
+      std::cerr << "Ignoring repeated filetype setting for "
+                << settings.extension << "\n";
+      continue;
+    }
+    m_byExtension.emplace(settings.extension, m_fileTypes.size());
+    m_fileTypes.push_back(std::move(settings));
+  }
+}
+
+uint32_t FileTypeTable::find(std::string_view path) const {
+  std::string_view extension = getExtension(path);
+  if (extension.empty())
+    return NotFound;
+  auto found = m_byExtension.find(extension);
+  return found != m_byExtension.end() ? found->second : NotFound;
+}
+
+std::string_view getExtension(std::string_view path) {
+  std::string_view filename = path.substr(path.rfind('/') + 1);
+  size_t dot = filename.rfind('.');
+  // "." and ".." have none, and a leading dot is a hidden file not an
+  // extension
+  if (dot == std::string_view::npos || dot == 0 || filename == "..")
+    return {};
+  return filename.substr(dot);
+}
+
+} // namespace AN
@@ -0,0 +1,65 @@
+#pragma once
+#include <cstdint>
+#include <filesystem>
+#include <functional>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+namespace AN {
+namespace fs = std::filesystem;
+
+// recognized types, what exe to run, and whether to keep after processing
+struct FileSettings {
+  std::string extension;
+  fs::path cmd{"/bin/echo"};
+  bool keep{true};
+  bool parallel{false};       // one cmd per file, else one per batch of files
+  // keep the cmd running and stream it files instead, see CoProcess
+  bool stream{false};
+  unsigned maxConcurrency{1}; // cmds of this type running at once
+  unsigned timeoutSeconds{0}; // kill cmd after this long, 0 never
+  // batches bigger than these are split over several cmds, see chunkFileList.
+  // 0 leaves it to what the system's argv limit allows
+  unsigned maxFilesPerCmd{0};
+  size_t maxArgBytes{0};
+};
+
+// extension -> FileSettings handling it, built once from the settings. Shared
+// read only by the scanners (which files to index at all) and the dispatcher
+// (which cmd each new file goes to), so lookups can come from any thread
+class FileTypeTable {
+public:
+  static constexpr uint32_t NotFound = UINT32_MAX;
+
+  FileTypeTable() = default;
+  // the first setting listed for an extension wins, later ones are ignored
+  explicit FileTypeTable(std::vector<FileSettings> fileTypes);
+
+  // index into fileTypes() for this file's extension, or NotFound. Works on
+  // the path string directly, no fs::path::extension() copy
+  uint32_t find(std::string_view path) const;
+  bool contains(std::string_view path) const { return find(path) != NotFound; }
+
+  const std::vector<FileSettings> &fileTypes() const { return m_fileTypes; }
+  size_t size() const { return m_fileTypes.size(); }
+
+private:
+  // lets find() look up a string_view without building a std::string
+  struct ExtensionHash {
+    using is_transparent = void;
+    size_t operator()(std::string_view extension) const {
+      return std::hash<std::string_view>{}(extension);
+    }
+  };
+
+  std::vector<FileSettings> m_fileTypes;
+  std::unordered_map<std::string, uint32_t, ExtensionHash, std::equal_to<>>
+      m_byExtension;
+};
+
+// same as fs::path::extension(), as a view into path. Empty for none
+std::string_view getExtension(std::string_view path);
+
+} // namespace AN
@@ -0,0 +1,201 @@
+#include "Fingerprint.hpp"
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <vector>
+
+namespace AN {
+
+// bytes hashed from each end of the file
+constexpr size_t HashBlockSize = 64 * 1024;
+
+static int64_t toNs(const struct timespec &time) {
+  return static_cast<int64_t>(time.tv_sec) * 1000000000 + time.tv_nsec;
+}
+
+static FileFingerprint toFingerprint(const struct stat &attributes) {
+#ifdef __APPLE__
+  const struct timespec &mtime = attributes.st_mtimespec;
+#else
+  const struct timespec &mtime = attributes.st_mtim;
+#endif
+  return {toNs(mtime), static_cast<uint64_t>(attributes.st_size),
+          static_cast<uint64_t>(attributes.st_ino)};
+}
+
+static DirStamp toDirStamp(const struct stat &attributes) {
+  if (!S_ISDIR(attributes.st_mode))
+    return {};
+#ifdef __APPLE__
+  const struct timespec &mtime = attributes.st_mtimespec;
+#else
+  const struct timespec &mtime = attributes.st_mtim;
+#endif
+  return {toNs(mtime), static_cast<uint64_t>(attributes.st_ino),
+          static_cast<uint64_t>(attributes.st_nlink)};
+}
+
+FileFingerprint getFingerprint(const fs::path &path) {
+  struct stat attributes;
+  if (stat(path.c_str(), &attributes) == -1)
+    return {};
+  return toFingerprint(attributes);
+}
+
+FileFingerprint getFingerprintAt(int dirFd, const char *name) {
+#ifdef STATX_INO
+  struct statx fields;
+  if (statx(dirFd, name, 0, STATX_MTIME | STATX_SIZE | STATX_INO, &fields) ==
+      0) {
+    return {static_cast<int64_t>(fields.stx_mtime.tv_sec) * 1000000000 +
+                fields.stx_mtime.tv_nsec,
+            fields.stx_size, fields.stx_ino};
+  }
+  if (errno != ENOSYS)
+    return {};
+  // kernel older than statx (4.11), fstatat does the same with every field
+#endif
+  struct stat attributes;
+  if (fstatat(dirFd, name, &attributes, 0) == -1)
+    return {};
+  return toFingerprint(attributes);
+}
+
+DirStamp getDirStamp(const fs::path &dir) {
+  struct stat attributes;
+  if (stat(dir.c_str(), &attributes) == -1)
+    return {};
+  return toDirStamp(attributes);
+}
+
+DirStamp getDirStamp(int dirFd) {
+  struct stat attributes;
+  if (fstat(dirFd, &attributes) == -1)
+    return {};
+  return toDirStamp(attributes);
+}
+
+static bool readFully(int fd, char *buffer, size_t length, off_t offset) {
+  while (length > 0) {
+    ssize_t num = pread(fd, buffer, length, offset);
+    if (num == -1 && errno == EINTR)
+      continue;
+    if (num <= 0)
+      return false; // error, or shrunk since the stat
+    buffer += num;
+    length -= num;
+    offset += num;
+  }
+  return true;
+}
+
+uint64_t hashFileEnds(const fs::path &path, uint64_t size) {
+  int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+  if (fd == -1)
+    return 0;
+
+  size_t headLength = std::min<uint64_t>(size, HashBlockSize);
+  // tail doesn't overlap the head, small files are just hashed once
+  size_t tailLength = std::min<uint64_t>(size - headLength, HashBlockSize);
+  std::vector<char> buffer(headLength + tailLength);
+  bool ok = readFully(fd, buffer.data(), headLength, 0) &&
+            readFully(fd, buffer.data() + headLength, tailLength,
+                      size - tailLength);
+  close(fd);
+  if (!ok)
+    return 0;
+
+  uint64_t hash = xxHash64(buffer.data(), buffer.size(), size);
+  return hash ? hash : 1; // 0 is kept for not hashed
+}
+
+// XXH64 as specified at github.com/Cyan4973/xxHash, little endian hosts only
+constexpr uint64_t Prime1 = 11400714785074694791ULL;
+constexpr uint64_t Prime2 = 14029467366897019727ULL;
+constexpr uint64_t Prime3 = 1609587929392839161ULL;
+constexpr uint64_t Prime4 = 9650029242287828579ULL;
+constexpr uint64_t Prime5 = 2870177450012600261ULL;
+
+static uint64_t rotateLeft(uint64_t value, int bits) {
+  return (value << bits) | (value >> (64 - bits));
+}
+
+static uint64_t read64(const unsigned char *data) {
+  uint64_t value;
+  memcpy(&value, data, sizeof(value));
+  return value;
+}
+
+static uint32_t read32(const unsigned char *data) {
+  uint32_t value;
+  memcpy(&value, data, sizeof(value));
+  return value;
+}
+
+static uint64_t hashRound(uint64_t accumulator, uint64_t input) {
+  accumulator += input * Prime2;
+  return rotateLeft(accumulator, 31) * Prime1;
+}
+
+static uint64_t mergeRound(uint64_t accumulator, uint64_t value) {
+  accumulator ^= hashRound(0, value);
+  return accumulator * Prime1 + Prime4;
+}
+
+uint64_t xxHash64(const void *data, size_t length, uint64_t seed) {
+  const unsigned char *input = static_cast<const unsigned char *>(data);
+  const unsigned char *end = input + length;
+  uint64_t hash;
+
+  if (length >= 32) {
+    uint64_t v1 = seed + Prime1 + Prime2;
+    uint64_t v2 = seed + Prime2;
+    uint64_t v3 = seed;
+    uint64_t v4 = seed - Prime1;
+    const unsigned char *limit = end - 32;
+    do {
+      v1 = hashRound(v1, read64(input));
+      v2 = hashRound(v2, read64(input + 8));
+      v3 = hashRound(v3, read64(input + 16));
+      v4 = hashRound(v4, read64(input + 24));
+      input += 32;
+    } while (input <= limit);
+
+    hash = rotateLeft(v1, 1) + rotateLeft(v2, 7) + rotateLeft(v3, 12) +
+           rotateLeft(v4, 18);
+    hash = mergeRound(hash, v1);
+    hash = mergeRound(hash, v2);
+    hash = mergeRound(hash, v3);
+    hash = mergeRound(hash, v4);
+  } else {
+    hash = seed + Prime5;
+  }
+  hash += length;
+
+  for (; input + 8 <= end; input += 8) {
+    hash ^= hashRound(0, read64(input));
+    hash = rotateLeft(hash, 27) * Prime1 + Prime4;
+  }
+  if (input + 4 <= end) {
+    hash ^= read32(input) * Prime1;
+    hash = rotateLeft(hash, 23) * Prime2 + Prime3;
+    input += 4;
+  }
+  for (; input < end; ++input) {
+    hash ^= *input * Prime5;
+    hash = rotateLeft(hash, 11) * Prime1;
+  }
+
+  hash ^= hash >> 33;
+  hash *= Prime2;
+  hash ^= hash >> 29;
+  hash *= Prime3;
+  hash ^= hash >> 32;
+  return hash;
+}
+
+} // namespace AN
@@ -0,0 +1,72 @@
+#pragma once
+#include <cstddef>
+#include <cstdint>
+#include <filesystem>
+
+namespace AN {
+namespace fs = std::filesystem;
+
+// what a file looked like when it was last seen. All zero means unknown eg
+// restored from a backup written before fingerprints were kept
+struct FileFingerprint {
+  int64_t mtimeNs{0};
+  uint64_t size{0};
+  uint64_t inode{0};
+  uint64_t contentHash{0}; // see hashFileEnds, 0 if never hashed
+
+  bool isKnown() const { return mtimeNs != 0 || size != 0 || inode != 0; }
+  // stat says nothing changed, contentHash isn't looked at
+  bool sameMetadata(const FileFingerprint &other) const {
+    return mtimeNs == other.mtimeNs && size == other.size &&
+           inode == other.inode;
+  }
+};
+
+// what a folder's own entry looked like when everything directly in it was
+// last listed. Adding, removing or renaming anything in it moves its mtime,
+// so the same stamp means the same names are still in it. Files rewritten in
+// place don't touch it though. All zero means never listed. mtimeNs 0 alone
+// means listed, but not to be trusted, so it never matches and is listed
+// again
+struct DirStamp {
+  int64_t mtimeNs{0};
+  uint64_t inode{0}; // replaced by another folder of the same name
+  // st_nlink, its entry count on APFS/HFS+ and its subfolder count (+ 2) on
+  // most linux filesystems. Comes free with the stat, and still moves if the
+  // mtime was put back or is too coarse to show a change
+  uint64_t linkCount{0};
+
+  bool isKnown() const { return mtimeNs != 0 || inode != 0; }
+  bool operator==(const DirStamp &other) const = default;
+};
+
+// how FolderScanner decides a file it has seen before needs processing again
+enum ChangeDetection : uint8_t {
+  // any change to mtime, size or inode (replaced by a new copy)
+  ChangeMetadata,
+  // as above, then only if the hash of the first and last blocks differs too,
+  // so touched or identically recopied files are skipped
+  ChangeContent,
+};
+
+// stat the file, unknown if it's gone. Doesn't read it so doesn't change its
+// atime either
+FileFingerprint getFingerprint(const fs::path &path);
+
+// as getFingerprint, for name in the folder open as dirFd, so the folder's
+// path isn't resolved again for every file in it. On linux statx is asked for
+// only the fields a fingerprint needs
+FileFingerprint getFingerprintAt(int dirFd, const char *name);
+
+// stat the folder, unknown if it's gone or not a folder
+DirStamp getDirStamp(const fs::path &dir);
+// as above, for a folder already open as dirFd
+DirStamp getDirStamp(int dirFd);
+
+// xxHash64 of the first and last 64 KB plus the size, 0 if unreadable. Not the
+// whole file, cheap enough to run on every changed file in a big library
+uint64_t hashFileEnds(const fs::path &path, uint64_t size);
+
+uint64_t xxHash64(const void *data, size_t length, uint64_t seed = 0);
+
+} // namespace AN
@@ -1,25 +1,24 @@
 #include "FoldersManager.hpp"
 #include "BackupManager.hpp"
+#include "DirectoryReader.hpp"
+#include "DirectoryWalker.hpp"
+#include "EventQueue.hpp"
+#include "ExecutorPool.hpp"
 #include "SettingsManager.hpp"
+#include "SettleQueue.hpp"
 
 #include <algorithm>
-#include <array>
-#include <condition_variable>
+#include <chrono>
 #include <cstdint>
 #include <cstdlib>
 #include <cstring>
 #include <filesystem>
-#include <fstream>
+#include <functional>
 #include <iostream>
 #include <memory>
-#include <mutex>
-#include <numeric>
-#include <poll.h>
-#include <ranges>
+#include <optional>
 #include <string>
-#include <sys/poll.h>
 #include <sys/socket.h>
-#include <sys/stat.h>
 #include <tuple>
 #include <unistd.h>
 #include <vector>
@@ -30,297 +29,517 @@ namespace fs = std::filesystem;
 // filename in temp directory for socket communication
 std::string SocketAddr;
 
-std::condition_variable doScanCV;
-std::mutex doScanMutex;
-bool doScan;
-
-void fileListExecutor(const fs::path &command,
-                      std::span<const fs::path> filenames, bool doParallel,
-                      bool keep) {
-  // void fileListExecutor(const fs::path &command,
-  //                       std::set<fs::path> filenames, bool doParallel) {
-  const int commandLen = strlen(command.c_str());
-
-  // do basic fork exec for the command on each filename
-  if (doParallel) {
-    // wrap in a thread loop:
-    std::vector<std::thread> threads;
-    // fork 'command' for each and every filename
-    for (const auto &file : filenames) {
-      // first set up argv char**
-      // allocate space
-      int argc = 2; // command and 1 file
-      char **argv = static_cast<char **>(malloc(sizeof(char) * (argc + 1)));
-      argv[0] = static_cast<char *>(malloc(sizeof(char) * commandLen + 1));
-      argv[1] = static_cast<char *>(
-          malloc(sizeof(char) * (strlen(file.c_str()) + 1)));
-      // copy contents
-      strcpy(argv[0], command.c_str());
-      strcpy(argv[1], file.c_str());
-      argv[2] = nullptr;
-
-      // printArgs(argc, argv);
-      threads.emplace_back(std::thread([&]() {
-        int ps = fork();
-        if (!ps) {
-          // child
-          execv(command.c_str(), argv);
-        } else {
-          int ret;
-          if (waitpid(ps, &ret, 0) == -1) {
-            std::cerr << "Error waiting for pid: " << ps << "\n";
-            exit(EXIT_FAILURE);
-          }
-        }
-        std::cout << "processing eg" << argv[1] << "\n";
-      }));
-    }
-
-    for (auto &thread : threads) {
-      thread.join();
-    }
-
-  } else {
-    // all filenames piped to single 'command' fork
-    // first set up argv char**
-    int argc = 1 + filenames.size(); // +1 for 0th ie executable name
-    char **argv = static_cast<char **>(
-        malloc(sizeof(char) * (argc + 1))); // +1 for final null element
-
-    argv[0] = static_cast<char *>(malloc(sizeof(char) * (commandLen + 1)));
-    strncpy(argv[0], command.c_str(), commandLen + 1);
-
-    for (int i = 1; i < argc; ++i) {
-      argv[i] = static_cast<char *>(
-          malloc(sizeof(char) * (strlen(filenames[i - 1].c_str()) + 1)));
-      strncpy(argv[i], filenames[i - 1].c_str(),
-              strlen(filenames[i - 1].c_str()) + 1);
-    }
-    argv[argc] = nullptr;
-    // printArgs(argc, argv);
-
-    int ps = fork();
-    if (!ps) {
-      execv(command.c_str(), argv);
-    } else {
-      int ret;
-      if (waitpid(ps, &ret, 0) == -1) {
-        std::cerr << "Error waiting for pid: " << ps << "\n";
-        exit(EXIT_FAILURE);
-      }
-    }
-  }
-
-  // finished, delete original file if requested
-  if (!keep) {
-    for (const fs::path &file : filenames) {
-      // TODO replace with rm when done
-      std::string cmdStr = "echo " + file.string();
-      system(cmdStr.c_str());
-    }
-  }
-}
-
-std::vector<std::pair<fs::path, time_t>>
-FolderScanner::getFilesAndTimes() const {
-  std::vector<std::pair<fs::path, time_t>> filesAndTimes;
-  for (auto &elem : m_files) {
-    std::cout << elem.first << ";" << elem.second.second << "\n";
-    filesAndTimes.emplace_back(std::pair(elem.first, elem.second.second));
-  }
-  return filesAndTimes;
-}
+// events waiting for the run thread, past this many it rescans instead
+constexpr size_t EventQueueCapacity = 16 * 1024;
+// events taken off the queue at a time
+constexpr size_t EventDrainBatch = 1024;
+// ServerListFiles page size, when not asked for / at most
+constexpr size_t DefaultListLimit = 1000;
+constexpr size_t MaxListLimit = 10000;
+// ledger entries one ServerListFiles page looks at, so a filter that
+// matches little doesn't hold up the ledger scanning all of it in one go
+constexpr size_t ListScanBudget = 100000;
 
 fs::path FolderScanner::getRoot() const { return m_directoryRoot; }
 
-FolderScanner::FolderScanner(fs::path directory, BackupManager *backupManager)
-    : m_directoryRoot(directory), m_backupManager(backupManager) {
-  restoreContents();
-  scan(); // still need to check for newer files since then in case any files
-          // preceeding event id update
+FolderScanner::FolderScanner(fs::path directory, BackupManager *backupManager,
+                             const FileTypeTable *fileTypes,
+                             unsigned scanThreads,
+                             ChangeDetection changeDetection,
+                             StartupScan startupScan,
+                             const std::atomic<bool> *stop)
+    : m_directoryRoot(directory), m_files(directory), m_fileTypes(fileTypes),
+      m_scanThreads(scanThreads), m_changeDetection(changeDetection),
+      m_stop(stop), m_backupManager(backupManager) {
+  if (!restoreContents()) {
+    // kept out of the backup until it's all there, a root cut short would be
+    // restored next time with the rest of its files looking new
+    m_backupManager = nullptr;
+    scan();
+    m_backupManager = backupManager;
+    if (!isStopping())
+      backupContents();
+    // what's already there when a root is first watched is where it starts
+    // from, not work to do
+    beginBatch();
+  } else if (m_dirStamps.empty() || startupScan == StartupScanFull) {
+    scan(); // still need to check for newer files since then in case any files
+            // preceeding event id update
+  } else if (startupScan == StartupScanChanged) {
+    scanChanged(0); // root
+  }
+  // else the replayed events say what changed, and get scanned like any others
+  m_stop = nullptr; // whoever owns it needn't outlive us
 }
 
-FolderScanner::FolderScanner(fs::path directory) : m_directoryRoot(directory) {
+FolderScanner::FolderScanner(fs::path directory)
+    : m_directoryRoot(directory), m_files(directory) {
   restoreContents();
   scan(); // still need to check for newer files since then in case any files
           // preceeding event id update
 }
 
-time_t getFileTime(fs::path path) {
-  // returns last *access* time
-  struct stat attributes;
-  stat(path.c_str(), &attributes);
-  return attributes.st_atime;
+fs::path normaliseDir(const fs::path &dir) {
+  fs::path normal = dir.lexically_normal();
+  // trailing separator shows up as an empty last component
+  return normal.has_filename() ? normal : normal.parent_path();
 }
 
 bool isParentDir(const fs::path checkParent, const fs::path child) {
-  fs::path parent;
-  while ((parent = child.parent_path()) != child) {
-    // == child when at root, so incorrect if checkParent is root but root
-    // parent unlikely
-    if (checkParent == parent)
-      return true;
-  }
-  return false;
+  // compare whole components, so /a/b is not a parent of /a/bc
+  fs::path parent = normaliseDir(checkParent);
+  fs::path normalChild = normaliseDir(child);
+
+  auto [parentIt, childIt] = std::mismatch(parent.begin(), parent.end(),
+                                           normalChild.begin(),
+                                           normalChild.end());
+  // all of parent matched and child still has more to it
+  return parentIt == parent.end() && childIt != normalChild.end();
 }
 
-void FolderScanner::restoreContents() {
+bool FolderScanner::restoreContents() {
   if (!m_backupManager)
-    return;
+    return false;
   // not yet tracking here, start fresh
   if (!m_backupManager->isMonitoredRoot(m_directoryRoot))
-    return;
+    return false;
+
+  m_backupManager->forEachRootFile(
+      m_directoryRoot,
+      [this](std::string_view path, const FileFingerprint &fingerprint) {
+        FileRecord &record = m_files[m_files.insertPath(path).first];
+        record.state = Old;
+        record.fingerprint = fingerprint;
+      });
+
+  m_backupManager->forEachRootDir(
+      m_directoryRoot, [this](std::string_view dir, const DirStamp &stamp) {
+        uint32_t id = m_files.internDir(dir);
+        if (id >= m_dirStamps.size())
+          m_dirStamps.resize(id + 1);
+        m_dirStamps[id] = stamp;
+      });
+  return true;
+}
 
-  auto loadedTimes = m_backupManager->getRootMonitoredFiles(m_directoryRoot);
-  m_files.insert_range(loadedTimes | std::views::transform([](auto pathTime) {
-                         return std::tuple(
-                             pathTime.first,
-                             std::tuple(FileUpdateType::Old, pathTime.second));
-                       }));
+void FolderScanner::backupContents() {
+  if (!m_backupManager)
+    return;
+  forEachFile([this](const fs::path &path, const FileFingerprint &fingerprint) {
+    m_backupManager->fileUpdated(m_directoryRoot, path, fingerprint);
+  });
+  forEachDir([this](const fs::path &dir, const DirStamp &stamp) {
+    m_backupManager->dirUpdated(m_directoryRoot, dir, stamp);
+  });
 }
 
-int FolderScanner::scanDir(const fs::path subdir) {
-  for (const fs::directory_entry &entry :
-       fs::recursive_directory_iterator(subdir)) {
-    if (!isValidExtension(entry))
+void FolderScanner::scanChanged(uint32_t topDirId) {
+  // folders found while relisting are new, and scanned in full there and then
+  size_t knownDirs = m_files.dirCount();
+  for (uint32_t id = 0; id < knownDirs; ++id) {
+    if (isStopping())
+      return;
+    if (id != topDirId && !m_files.isDirUnder(id, topDirId))
+      continue;
+    fs::path dir = m_files.getDirPath(id);
+    DirStamp stamp = getDirStamp(dir);
+    // gone (its files are left be, as with any deleted file), or the same
+    // names in it as last time
+    if (!stamp.isKnown() ||
+        (id < m_dirStamps.size() && m_dirStamps[id] == stamp))
       continue;
 
-    FileUpdateType type;
-    time_t entryPosixTime = getFileTime(entry.path());
-    bool wasTracked = m_files.contains(entry.path());
+    DirectoryReader reader(dir);
+    DirectoryReader::Entry entry;
+    while (reader.next(entry)) {
+      if (!entry.isDir) {
+        scanEntry(dir, reader, entry.name);
+        continue;
+      }
+      // known ones get their own turn in this loop
+      fs::path subdir = dir / entry.name;
+      if (m_files.findDir(subdir) == StringPool::NotFound)
+        scanDir(subdir, true);
+    }
+    // a new folder in it cut short would be hidden behind the stamp
+    if (!reader.failed() && !isStopping())
+      stampDir(dir, stamp);
+  }
+}
+
+void FolderScanner::scanEntry(const fs::path &dir,
+                              const DirectoryReader &reader, const char *name) {
+  if (!isValidExtension(name))
+    return;
+  FileFingerprint fingerprint = reader.fingerprint(name);
+  // gone again since the listing
+  if (fingerprint.isKnown())
+    updateFile(dir / name, fingerprint);
+}
 
-    auto &updateFile = m_files[entry.path()]; // get or insert in either case...
-    if (wasTracked) {
-      type = entryPosixTime > updateFile.second ? Updated : Old;
-    } else {
-      type = New;
+uint32_t FolderScanner::getDirId(const fs::path &dir) {
+  if (dir != m_lastDir) {
+    m_lastDirId = m_files.internDir(dir);
+    m_lastDir = dir;
+  }
+  return m_lastDirId;
+}
+
+void FolderScanner::updateFile(const fs::path &path,
+                               FileFingerprint fingerprint) {
+  // get or insert in either case...
+  auto [id, inserted] =
+      m_files.insert(getDirId(path.parent_path()), path.filename().native());
+  FileRecord &record = m_files[id];
+  if (inserted) {
+    record.state = New;
+  } else if (record.fingerprint.sameMetadata(fingerprint)) {
+    return; // untouched, most files on a full scan
+  } else if (!record.fingerprint.isKnown()) {
+    // restored from a backup older than fingerprints, no way to tell so
+    // assume it was handled back then
+    record.state = Old;
+  } else {
+    record.state = Updated;
+  }
+
+  if (m_changeDetection == ChangeContent) {
+    // only ever files that are new or whose metadata changed
+    fingerprint.contentHash = hashFileEnds(path, fingerprint.size);
+    if (record.state == Updated && fingerprint.contentHash != 0 &&
+        fingerprint.contentHash == record.fingerprint.contentHash) {
+      record.state = Old; // touched or recopied, same bytes
     }
-    updateFile.first = type;
-    updateFile.second = entryPosixTime;
   }
-  return 1;
+  record.fingerprint = fingerprint;
+  if (record.state != Old)
+    m_batchFiles.push_back(id);
+  // even if Old the fingerprint moved on, keep the backup in step so the
+  // next scan doesn't have to look again
+  if (m_backupManager)
+    m_backupManager->fileUpdated(m_directoryRoot, path, fingerprint);
+}
+
+// a folder changed again within its filesystem's timestamp granularity of
+// being stamped would look the same as when it was stamped, so stamps this
+// fresh aren't trusted and the folder is listed again next time
+constexpr int64_t RacyStampNs = 2'000'000'000;
+
+void FolderScanner::stampDir(const fs::path &dir, DirStamp stamp) {
+  int64_t nowNs = std::chrono::duration_cast<std::chrono::nanoseconds>(
+                      std::chrono::system_clock::now().time_since_epoch())
+                      .count();
+  if (nowNs - stamp.mtimeNs < RacyStampNs)
+    stamp.mtimeNs = 0; // still saved, it's a folder to look at
+
+  uint32_t id = m_files.internDir(dir);
+  if (id >= m_dirStamps.size())
+    m_dirStamps.resize(id + 1);
+  if (m_dirStamps[id] == stamp)
+    return; // nothing new for the backup
+  m_dirStamps[id] = stamp;
+  if (m_backupManager)
+    m_backupManager->dirUpdated(m_directoryRoot, dir, stamp);
+}
+
+int FolderScanner::scanDir(const fs::path subdir, bool recursive) {
+  // stamped once all their files are recorded, so a crash in between leaves
+  // them to be listed again
+  std::vector<std::pair<fs::path, DirStamp>> listedDirs;
+  // depth first, folder symlinks are just entries and aren't followed
+  std::vector<fs::path> pendingDirs{subdir};
+  while (!pendingDirs.empty()) {
+    // nothing stamped, the folders listed so far could hide ones that weren't
+    if (isStopping())
+      return 0;
+    fs::path dir = std::move(pendingDirs.back());
+    pendingDirs.pop_back();
+    DirectoryReader reader(dir);
+    // before listing, so anything changed meanwhile moves it on. Unknown if
+    // the folder's gone again eg by the time its event gets here, one that
+    // couldn't be opened is still recorded below
+    DirStamp stamp = reader.stamp();
+    if (!stamp.isKnown())
+      continue;
+
+    DirectoryReader::Entry entry;
+    while (reader.next(entry)) {
+      if (!entry.isDir) {
+        scanEntry(dir, reader, entry.name);
+      } else if (recursive) {
+        pendingDirs.push_back(dir / entry.name);
+      } else if (m_files.findDir(dir / entry.name) == StringPool::NotFound) {
+        // not listed yet, so the stamp can't vouch for what's under it
+        stamp.mtimeNs = 0;
+      }
+    }
+    // unreadable, still remembered so its parent's stamp doesn't hide it,
+    // but tried again on every scan
+    if (reader.failed())
+      stamp.mtimeNs = 0;
+    listedDirs.emplace_back(std::move(dir), stamp);
+  }
+  for (const auto &[dir, dirStamp] : listedDirs) {
+    stampDir(dir, dirStamp);
+  }
+  return listedDirs.empty() ? 0 : 1;
 }
 
-int FolderScanner::scan() { return scanDir(m_directoryRoot); }
+int FolderScanner::scan() {
+  if (m_scanThreads <= 1)
+    return scanDir(m_directoryRoot, true);
+
+  // whole tree, worth fanning out. Results come back sorted so the batch order
+  // is the same every time
+  DirectoryWalker walker(m_scanThreads);
+  std::vector<WalkedDir> walkedDirs;
+  auto walkedFiles = walker.walk(
+      m_directoryRoot,
+      [this](std::string_view name) { return isValidExtension(name); },
+      &walkedDirs, m_stop);
+  if (isStopping())
+    return 0; // only partly walked, and on its way to being thrown away
+  for (const WalkedFile &file : walkedFiles) {
+    updateFile(file.path, file.fingerprint);
+  }
+  for (const WalkedDir &dir : walkedDirs) {
+    stampDir(dir.path, dir.stamp);
+  }
+  return 1;
+}
 
-int FolderScanner::scan(const fs::path subdir) {
-  if (!isParentDir(m_directoryRoot, subdir)) {
+int FolderScanner::scan(const fs::path subdir, DirtyScan depth) {
+  if (subdir != m_directoryRoot && !isParentDir(m_directoryRoot, subdir)) {
     return -1;
   }
-  return scanDir(subdir);
+  // everything again (overflowed queue), worth fanning out
+  if (depth == DirtyScanFull && subdir == m_directoryRoot)
+    return scan();
+  // a folder moved in only needs the folders in it that changed, if it's all
+  // been listed before
+  uint32_t dirId = m_files.findDir(subdir);
+  if (depth == DirtyScanChanged && dirId != StringPool::NotFound &&
+      dirId < m_dirStamps.size() && m_dirStamps[dirId].isKnown()) {
+    scanChanged(dirId);
+    return 1;
+  }
+  return scanDir(subdir, depth != DirtyScanFiles);
 }
 
-bool FolderScanner::isValidExtension(const fs::directory_entry &entry) {
-  return std::any_of(m_filetypeFilter.begin(), m_filetypeFilter.end(),
-                     [&](const std::string_view filetype) {
-                       return filetype == entry.path().extension();
-                     });
+void FolderScanner::beginBatch() {
+  for (FileIndex::RecordId id : m_batchFiles) {
+    m_files[id].state = Old;
+  }
+  m_batchFiles.clear();
+}
+
+bool FolderScanner::isValidExtension(std::string_view name) const {
+  return !m_fileTypes || m_fileTypes->contains(name);
 }
 
 std::vector<fs::path> FolderScanner::getNewFiles() const {
   std::vector<fs::path> outFiles;
-  for (auto &f : m_files) {
-    if (f.second.first == New || f.second.first == Updated) {
-      outFiles.emplace_back(f.first);
-    }
+  outFiles.reserve(m_batchFiles.size());
+  for (FileIndex::RecordId id : m_batchFiles) {
+    outFiles.push_back(m_files.getPath(id));
   }
   return outFiles;
 }
 
-void callback(ConstFSEventStreamRef stream, void *callbackInfo,
-              size_t numEvents, void *evPaths,
-              const FSEventStreamEventFlags evFlags[],
-              const FSEventStreamEventId evIds[]) {
-  {
-    std::lock_guard<std::mutex> lock(doScanMutex);
-    doScan = true;
+// work(i) for every i in [0, count), each on its own thread. The calling
+// thread does the first, so a single shard doesn't pay for a thread
+static void runSharded(size_t count, const std::function<void(size_t)> &work) {
+  std::vector<std::thread> threads;
+  for (size_t i = 1; i < count; ++i) {
+    threads.emplace_back(work, i);
   }
-  // this needs to come after the lock_guard is released:
-  doScanCV.notify_one();
+  if (count > 0)
+    work(0);
+  for (auto &thread : threads) {
+    thread.join();
+  }
+}
+
+// drop folders already covered by a full scan of one of their parents. A
+// DirtyScanChanged one can skip over a folder whose files changed in place,
+// so doesn't cover anything. fs::path orders by component so a folder's
+// subfolders directly follow it
+static std::vector<std::pair<fs::path, DirtyScan>>
+coalesceDirtyDirs(const DirtyDirs &dirtyDirs) {
+  std::vector<std::pair<fs::path, DirtyScan>> coalesced;
+  const fs::path *coveringDir = nullptr;
+  for (const auto &[dir, depth] : dirtyDirs) {
+    if (coveringDir && isParentDir(*coveringDir, dir))
+      continue;
+    coalesced.emplace_back(dir, depth);
+    coveringDir = depth == DirtyScanFull ? &dir : nullptr;
+  }
+  return coalesced;
+}
+
+void FoldersManager::handleEvents(std::span<const FileEvent> events) {
+  // just hand them over, the watcher thread never waits on a scan. If the
+  // queue is full the run thread finds out and rescans everything
+  for (const FileEvent &event : events) {
+    m_eventQueue->push(event);
+  }
+  m_eventQueue->notify();
   std::cout << "notified callback\n";
 }
 
+void FoldersManager::collectEvents(std::span<const FileEvent> events,
+                                   DirtyDirs &dirtyDirs,
+                                   ClosedFiles &closedFiles) {
+  for (const FileEvent &event : events) {
+    fs::path dir;
+    DirtyScan depth = DirtyScanFiles;
+    if (event.flags & EventMustRescan) {
+      // events under it were dropped, anything could have changed
+      dir = event.path;
+      depth = DirtyScanFull;
+    } else if ((event.flags & EventIsDir) &&
+               (event.flags & (EventCreated | EventRenamed)) &&
+               !(event.flags & EventRemoved)) {
+      // new or moved in folder, nothing under it has been seen yet
+      dir = event.path;
+      depth = DirtyScanChanged;
+    } else if ((event.flags & EventIsDir) && !(event.flags & EventRemoved)) {
+      // folder level event (FSEvents default), its direct contents changed
+      dir = event.path;
+    } else {
+      // file or removed folder, rescan what contains it
+      dir = event.path.parent_path();
+      if (event.flags & EventClosed)
+        closedFiles.insert(event.path);
+    }
+    // repeats of the same folder collapse into one scan here
+    DirtyScan &dirDepth = dirtyDirs[normaliseDir(dir)];
+    dirDepth = std::max(dirDepth, depth);
+  }
+}
+
 void FoldersManager::quitEventStream() {
-  if (!m_stream) {
+  if (!m_eventSource || !m_eventSource->isRunning()) {
     // has not yet been set up
     return;
   }
 
-  // still need to update latest log change log so next guy sees it's old news
-  m_latestEventId = FSEventStreamGetLatestEventId(m_stream);
-  m_logger.log("last event id: " + std::to_string(m_latestEventId) + "\n");
-
-  std::ofstream outfilelog(m_logFile, std::ios::out | std::ios::trunc);
-  if (outfilelog) {
-    outfilelog << m_latestEventId;
+  m_eventSource->stop();
+  // the run thread is done by now. Anything it left in the queue was never
+  // scanned, so next time has to replay from the last event it did scan.
+  // Otherwise the source's latest id covers the rest (events outside our
+  // roots etc) so the next replay starts from now
+  std::vector<FileEvent> unscanned;
+  if (m_eventQueue->drain(unscanned, 1) == 0 &&
+      !m_eventQueue->takeOverflowed()) {
+    m_latestEventId = m_eventSource->getLatestEventId();
   }
-  // TODO might need to check if currently running in case of double free :/
-  FSEventStreamStop(m_stream);
-  FSEventStreamInvalidate(m_stream);
-  FSEventStreamRelease(m_stream);
+  // saved with the rest of the backup, see getFolderManagerUpdate
+  m_logger.log("last event id: " + std::to_string(m_latestEventId) + "\n");
 }
 
 void FoldersManager::addFolders(std::span<fs::path> folderNames) {
-  // update file list, then close and restart event stream
+  // update file list, then start the event stream, or add to it if it's
+  // already going
   // add unique elements packed as a tuple
 
   // This prevents creation of unneeded scanners if !contains path compared to
   // fancy range approach
-  for (const auto &path : folderNames) {
-    if (!m_trackedFoldersAndScanners.contains(path)) {
-      m_trackedFoldersAndScanners.emplace(std::tuple(
-          path, std::move(FolderScanner(path, m_backupManager.get()))));
+  std::vector<fs::path> newRoots;
+  for (const auto &folderName : folderNames) {
+    // events report folders without trailing '/', keep roots matching them
+    fs::path path = normaliseDir(folderName);
+    if (!m_trackedFoldersAndScanners.contains(path) &&
+        std::find(newRoots.begin(), newRoots.end(), path) == newRoots.end()) {
+      newRoots.push_back(path);
     }
   }
-  quitEventStream();
-  createEventStream();
+
+  // watch first when we can, so nothing changed during the scans slips by
+  bool isStreaming = m_eventSource->isRunning();
+  if (isStreaming) {
+    for (const auto &root : newRoots) {
+      if (!m_eventSource->addRoot(root))
+        m_logger.logErr("Failed to watch " + root.string());
+    }
+  }
+
+  // where the event source can replay what happened while we were down, the
+  // stream about to start covers the restored roots and they needn't be
+  // looked at. Otherwise each new scanner catches up on its root, do them
+  // all at once
+  StartupScan startupScan = m_startupScan;
+  if (!isStreaming && startupScan == StartupScanChanged &&
+      m_eventSource->canReplay() &&
+      m_backupManager->getLastObservedEventId() != EventIdSinceNow) {
+    startupScan = StartupScanReplayed;
+  }
+  std::vector<std::optional<FolderScanner>> newScanners(newRoots.size());
+  runSharded(newRoots.size(), [&](size_t i) {
+    newScanners[i].emplace(newRoots[i], m_backupManager.get(), &m_fileTypes,
+                           m_scanThreads, m_changeDetection, startupScan);
+  });
+  for (size_t i = 0; i < newRoots.size(); ++i) {
+    m_trackedFoldersAndScanners.emplace(
+        std::tuple(newRoots[i], std::move(*newScanners[i])));
+  }
+  if (!isStreaming)
+    createEventStream();
 }
 
 void FoldersManager::createEventStream() {
-  CFMutableArrayRef pathRefs = CFArrayCreateMutable(nullptr, 0, nullptr);
+  std::vector<fs::path> roots;
   for (const auto &folderAndScanner : m_trackedFoldersAndScanners) {
-    fs::path folderName = folderAndScanner.first;
-
-    CFStringRef arg = CFStringCreateWithCString(
-        kCFAllocatorDefault, folderName.c_str(), kCFStringEncodingUTF8);
-
-    CFArrayRef paths = CFArrayCreate(NULL, (const void **)&arg, 1, NULL);
-
-    CFArrayAppendArray(pathRefs, paths,
-                       CFRangeMake(0, 1)); // check rangemake second argument,
-                                           // 1 elem or length of string data?
-    CFAbsoluteTime latency = 3.0;          // TODO control later?
-
-    m_latestEventId = m_backupManager->getLastObservedEventId();
-    m_stream =
-        FSEventStreamCreate(NULL, &callback, nullptr, paths, m_latestEventId,
-                            latency, kFSEventStreamCreateFlagNone);
+    roots.push_back(folderAndScanner.first);
+  }
 
-    FSEventStreamSetDispatchQueue(m_stream, m_queue);
-    if (!FSEventStreamStart(m_stream)) {
-      std::cerr << "Failed to start stream\n";
-      exit(EXIT_FAILURE);
-    }
+  EventId sinceWhen = m_backupManager->getLastObservedEventId();
+  if (!m_eventSource->start(roots, sinceWhen)) {
+    m_logger.logErr("Failed to start event stream");
+    exit(EXIT_FAILURE);
   }
+  // where events carry on from, moved on by the run thread as they're scanned
+  m_latestEventId = m_eventSource->getLatestEventId();
 }
 
 FoldersManager::FoldersManager() : m_logger(STDOUT_FILENO) {
-  m_queue = dispatch_queue_create(nullptr, DISPATCH_QUEUE_SERIAL);
-
   // convert to absolute file path
-  m_logFile = fs::current_path() / m_logFile;
-  m_backupManager = std::make_unique<JsonManager>(m_logFile);
+  m_fileTypeFile = fs::current_path() / m_fileTypeFile;
+  loadSettings();
+
+  m_eventQueue = std::make_unique<EventQueue>(EventQueueCapacity);
+  m_eventSource = makeEventSource(
+      [this](std::span<const FileEvent> events) { handleEvents(events); },
+      m_eventLatency);
 
   // convert to absolute file path
-  m_fileTypeFile = fs::current_path() / m_fileTypeFile;
-  loadFileTypes();
+  m_logFile = fs::current_path() / m_logFile;
+  m_backupManager = makeBackupManager(m_backupBackend, m_logFile);
+
+  m_controlServer = std::make_unique<ControlServer>(
+      SocketAddr,
+      [this](uint16_t command, std::string_view payload, int client,
+             std::string &out) {
+        return handleMessage(command, payload, client, out);
+      });
+  m_settleQueue = std::make_unique<SettleQueue>(
+      std::chrono::milliseconds(static_cast<int64_t>(m_settleSeconds * 1000)));
+  // a failure schedules a retry the run thread may not be waiting for yet
+  m_ledger = std::make_unique<ProcessingLedger>(
+      m_backupManager.get(), m_retryPolicy,
+      [this]() { m_eventQueue->notify(); },
+      [this](const fs::path &file, const LedgerEntry *entry, bool forgotten) {
+        publishChange(file, entry, forgotten);
+      });
+  m_ledger->restore();
+  m_executorPool = std::make_unique<ExecutorPool>(
+      m_executorThreads, m_executorQueueSize, m_ledger.get());
 }
 
 FoldersManager::FoldersManager(std::vector<fs::path> folderNames)
     : FoldersManager() {
+  // also sets up the event stream monitors:
   addFolders(folderNames);
-  // set up fseventstream monitors:
-  createEventStream();
 }
 
 FoldersManager::~FoldersManager() {
@@ -328,7 +547,6 @@ FoldersManager::~FoldersManager() {
     stop();
   }
   quitEventStream();
-  dispatch_release(m_queue);
 
   m_backupManager->getFolderManagerUpdate(*this);
   // query final backup data from managed scanners
@@ -346,246 +564,486 @@ void FoldersManager::run() {
   m_isRunning.store(true);
   // launch a thread
   m_runThread = std::thread([this]() {
+    resumeUnfinished();
+    // and whatever changed while we were down, found by the scanners'
+    // startup scans
+    std::vector<fs::path> newFiles;
+    for (auto &folderAndScanner : m_trackedFoldersAndScanners) {
+      queueNewFiles(folderAndScanner.second, newFiles);
+    }
+    m_ledger->discovered(newFiles);
+    m_backupManager->flush();
+    std::vector<FileEvent> events;
     while (1) {
-      {
-        std::lock_guard<std::mutex> lock(doScanMutex);
-        doScan = false;
+      // first wait for events, or until a waiting file could settle or a
+      // failed one is due another go
+      auto deadline = m_settleQueue->nextDeadline();
+      if (auto retry = m_ledger->nextRetry())
+        deadline = deadline ? std::min(*deadline, *retry) : *retry;
+      int timeoutMs = -1;
+      if (deadline) {
+        auto wait = std::chrono::ceil<std::chrono::milliseconds>(
+            *deadline - SettleQueue::Clock::now());
+        timeoutMs = std::clamp<int64_t>(wait.count(), 0, INT32_MAX);
       }
-      // first wait for pipe/mutex+cv
-      std::unique_lock<std::mutex> uniqueLock(doScanMutex);
-      // cvSyncFSEventStreamToFolderManager.wait(uniqueLock);
-      doScanCV.wait(uniqueLock, []() { return doScan; });
-      uniqueLock.unlock(); // wait leaves mutex locked so need to release
+      m_eventQueue->wait(timeoutMs);
 
       if (!m_isRunning.load())
         break;
 
-      std::vector<fs::path> filesToProcess;
-      // index and get list of all new files:
-      for (auto &folderAndScanner : m_trackedFoldersAndScanners) {
-        FolderScanner &folderScanner = folderAndScanner.second;
-        if (folderScanner.scan() == -1) {
+      // everything queued up to now goes in this batch
+      DirtyDirs dirtyDirs;
+      ClosedFiles closedFiles;
+      EventId drainedEventId = m_latestEventId;
+      while (m_eventQueue->drain(events, EventDrainBatch) > 0) {
+        for (const FileEvent &event : events) {
+          drainedEventId = std::max(drainedEventId, event.id);
+        }
+        collectEvents(events, dirtyDirs, closedFiles);
+        events.clear();
+      }
+      if (m_eventQueue->takeOverflowed()) {
+        std::cerr << "Event queue overflowed, rescanning everything\n";
+        for (const auto &folderAndScanner : m_trackedFoldersAndScanners) {
+          dirtyDirs[folderAndScanner.first] = DirtyScanFull;
+        }
+        for (const auto &rootAndPending : m_pendingRoots) {
+          dirtyDirs[rootAndPending.first] = DirtyScanFull;
+        }
+      }
+
+      applyRootChanges(dirtyDirs);
+      // roots still on their first scan can't take events yet, keep them for
+      // when they can
+      for (auto &[root, pending] : m_pendingRoots) {
+        for (const auto &[dir, depth] : dirtyDirs) {
+          if (dir == root || isParentDir(root, dir)) {
+            DirtyScan &pendingDepth = pending.dirtyDirs[dir];
+            pendingDepth = std::max(pendingDepth, depth);
+          }
+        }
+      }
+
+      // woken just to check on the settle queue, keep the last batch around
+      if (!dirtyDirs.empty()) {
+        for (auto &folderAndScanner : m_trackedFoldersAndScanners) {
+          folderAndScanner.second.beginBatch();
+        }
+
+        // index only the folders events touched, in every root containing
+        // them. Grouped by root since each scanner only touches its own
+        // state, so roots (often separate disks) scan at the same time
+        auto coalescedDirs = coalesceDirtyDirs(dirtyDirs);
+        std::vector<std::pair<FolderScanner *,
+                              std::vector<std::pair<fs::path, DirtyScan>>>>
+            shards;
+        for (auto &folderAndScanner : m_trackedFoldersAndScanners) {
+          const fs::path &root = folderAndScanner.first;
+          std::vector<std::pair<fs::path, DirtyScan>> rootDirs;
+          for (const auto &dirAndDepth : coalescedDirs) {
+            const fs::path &dir = dirAndDepth.first;
+            if (dir == root || isParentDir(root, dir))
+              rootDirs.push_back(dirAndDepth);
+          }
+          if (!rootDirs.empty())
+            shards.emplace_back(&folderAndScanner.second, std::move(rootDirs));
+        }
+
+        std::atomic_bool scanFailed{false};
+        runSharded(shards.size(), [&](size_t i) {
+          auto &[scanner, dirs] = shards[i];
+          for (const auto &[dir, depth] : dirs) {
+            if (scanner->scan(dir, depth) == -1)
+              scanFailed.store(true);
+          }
+        });
+        if (scanFailed.load()) {
           std::cerr << "Error: Failed to complete folder scan.";
           exit(EXIT_FAILURE);
         }
-        for (const auto &newFile : folderScanner.getNewFiles()) {
-          std::cout << newFile << "\n";
-          filesToProcess.push_back(newFile);
+
+        std::vector<fs::path> newFiles;
+        for (auto &folderAndScanner : m_trackedFoldersAndScanners) {
+          queueNewFiles(folderAndScanner.second, newFiles);
         }
+        m_ledger->discovered(newFiles);
+        // make this batch's changes durable before acting on them
+        m_backupManager->flush();
       }
+      // everything up to here is scanned, a restart can replay from after it
+      m_latestEventId = drainedEventId;
 
-      // pass to executor
-      // filter based on settings which cmd and whether to keep
-      for (auto &fileSetting : m_fileTypes) {
-        // filter files to match this particular extension + settings:
-        std::vector<fs::path> filteredFiles;
-        filteredFiles.append_range(
-            filesToProcess | std::views::filter([&fileSetting](auto f) {
-              return f.extension() == fileSetting.extension;
-            }));
-
-        std::cout << "executing for extension:" << fileSetting.extension
-                  << "\n";
-        fileListExecutor(fileSetting.cmd, filteredFiles, false,
-                         fileSetting.keep);
+      for (const auto &file : closedFiles) {
+        m_settleQueue->closed(file);
+      }
+      auto now = SettleQueue::Clock::now();
+      std::vector<fs::path> vanished;
+      std::vector<fs::path> filesToProcess =
+          m_settleQueue->takeSettled(now, &vanished);
+      // nothing left of them to process
+      for (const auto &file : vanished) {
+        m_ledger->forget(file);
       }
+      m_ledger->advance(filesToProcess, ProcessStable);
+      for (auto &file : m_ledger->takeDueRetries(now)) {
+        // a failed cmd leaves its file be, unless something else moved it
+        if (fs::exists(file))
+          filesToProcess.push_back(std::move(file));
+        else
+          m_ledger->forget(file);
+      }
+      if (!filesToProcess.empty())
+        dispatch(std::move(filesToProcess));
+    }
+    // added roots still scanning have nowhere to go, but can't be left
+    // running. Stopped first so a big one doesn't hold up quitting
+    for (auto &rootAndPending : m_pendingRoots) {
+      rootAndPending.second.stopScan = true;
     }
+    for (auto &rootAndPending : m_pendingRoots) {
+      rootAndPending.second.scanThread.join();
+    }
+    m_pendingRoots.clear();
     m_logger.log("NOTE I am quitting nicely");
   });
 }
 
-void FoldersManager::stop() {
-  quitThread();
-  m_runThread.join();
-}
-
-void FoldersManager::serverStart() {
-  m_isServerRunning = true;
-  // make enum of recognized signals, separate out server class which dispatches
-  // these commands to here, read from the socket
-  m_serverSock = socket(AF_UNIX, SOCK_STREAM, 0);
-  if (m_serverSock == 1) {
-    m_logger.logErr("Unable to open socket.");
-    exit(EXIT_FAILURE);
+void FoldersManager::applyRootChanges(DirtyDirs &dirtyDirs) {
+  std::vector<std::pair<fs::path, bool>> changes;
+  std::vector<std::pair<fs::path, FolderScanner>> scannedRoots;
+  {
+    std::lock_guard<std::mutex> lock(m_rootChangesMutex);
+    changes.swap(m_rootChanges);
+    scannedRoots.swap(m_scannedRoots);
   }
 
-  // fill out local socket address binding
-  struct sockaddr_un local;
-  // remote filled by accept()
-  local.sun_family = AF_UNIX;
-  // point us to the socket address
-  strcpy(local.sun_path, SocketAddr.c_str());
-  local.sun_len = (sizeof(local.sun_family) + strlen(local.sun_path) + 1);
-
-  // delete file if already existing
-  unlink(local.sun_path);
-  // bind socket num to file address
-  if (bind(m_serverSock, (struct sockaddr *)&local, local.sun_len) == -1) {
-    m_logger.logErr("Unable to bind socket to address: " + SocketAddr + "\n" +
-                    strerror(errno));
-    exit(EXIT_FAILURE);
+  for (auto &[root, scanner] : scannedRoots) {
+    auto pending = m_pendingRoots.find(root);
+    pending->second.scanThread.join(); // already on its way out
+    if (!pending->second.isRemoved && pending->second.stopScan.load()) {
+      // removed and added again, the scan may have stopped short so go again.
+      // Events held back so far still stand
+      pending->second.stopScan = false;
+      startFirstScan(root, pending->second);
+      continue;
+    }
+    if (!pending->second.isRemoved) {
+      for (const auto &[dir, depth] : pending->second.dirtyDirs) {
+        DirtyScan &dirDepth = dirtyDirs[dir];
+        dirDepth = std::max(dirDepth, depth);
+      }
+      // known from before, so its first scan caught up on what changed since
+      std::vector<fs::path> newFiles;
+      queueNewFiles(scanner, newFiles);
+      m_ledger->discovered(newFiles);
+      m_trackedFoldersAndScanners.emplace(root, std::move(scanner));
+      m_logger.log("now monitoring " + root.string());
+    }
+    m_pendingRoots.erase(pending);
   }
 
-  if (listen(m_serverSock, 3) == -1) {
-    m_logger.logErr("Unable to set listen.");
-    exit(EXIT_FAILURE);
+  // in the order asked for, so add then remove leaves it removed
+  for (const auto &[root, isAdd] : changes) {
+    if (isAdd)
+      addRoot(root);
+    else
+      removeRoot(root);
   }
+}
 
-  while (m_isServerRunning) {
-    m_logger.log("Waiting for connections");
+void FoldersManager::addRoot(const fs::path &root) {
+  if (m_trackedFoldersAndScanners.contains(root))
+    return;
+  auto pending = m_pendingRoots.find(root);
+  if (pending != m_pendingRoots.end() && !pending->second.isRemoved)
+    return;
 
-    struct sockaddr_un remote;
-    socklen_t remoteLen = sizeof(remote);
-    // fill out received client address binding
-    m_clientSock =
-        accept(m_serverSock, reinterpret_cast<sockaddr *>(&remote), &remoteLen);
-    if (m_clientSock == -1) {
-      m_logger.logErr("Error in client accept(): " +
-                      std::string(strerror(errno)));
-    }
-    m_logger.log("Received connection" + std::to_string(m_clientSock));
-
-    // TODO note crashing fcntl when file touched despite no client connected
-    // Can maybe ignore
-    // set socket to be nonblocking
-    int fcntlFlags = fcntl(m_clientSock, F_GETFL, 0);
-    if (fcntlFlags == -1) {
-      m_logger.logErr("error in fcntlFlags");
-    } else if (fcntl(m_clientSock, F_SETFL, fcntlFlags | O_NONBLOCK) == -1) {
-      m_logger.logErr("Unable to set socket to nonblocking: " +
-                      std::string(strerror(errno)));
-      exit(EXIT_FAILURE);
+  // watch first, so nothing changed during the scan slips by
+  if (!m_eventSource->addRoot(root)) {
+    m_logger.logErr("Failed to watch " + root.string());
+    return;
+  }
+  if (pending != m_pendingRoots.end()) {
+    // removed and added again while it scanned, applyRootChanges starts it
+    // over if it was stopped
+    pending->second.isRemoved = false;
+    return;
+  }
+  startFirstScan(root, m_pendingRoots[root]);
+}
+
+void FoldersManager::startFirstScan(const fs::path &root,
+                                    PendingRoot &pending) {
+  // a full scan of a big root takes a while, the others carry on meanwhile.
+  // pending stays put in m_pendingRoots until the thread's joined
+  pending.scanThread = std::thread([this, root, stop = &pending.stopScan]() {
+    FolderScanner scanner(root, m_backupManager.get(), &m_fileTypes,
+                          m_scanThreads, m_changeDetection, m_startupScan,
+                          stop);
+    {
+      std::lock_guard<std::mutex> lock(m_rootChangesMutex);
+      m_scannedRoots.emplace_back(root, std::move(scanner));
     }
+    m_eventQueue->notify();
+  });
+}
 
-    // now do poll loop waiting for message from pair
-    std::array<struct pollfd, 1> pollFds;
-    pollFds[0].fd = m_clientSock;
-    pollFds[0].events = POLLIN | POLLHUP;
+void FoldersManager::removeRoot(const fs::path &root) {
+  auto pending = m_pendingRoots.find(root);
+  if (pending != m_pendingRoots.end()) {
+    // dropped once its scan is done, which needn't finish now
+    pending->second.isRemoved = true;
+    pending->second.stopScan = true;
+    m_eventSource->removeRoot(root);
+    return;
+  }
+  if (m_trackedFoldersAndScanners.erase(root) == 0)
+    return;
+  m_eventSource->removeRoot(root);
+  // cmds already handed to the executor still run, anything not yet there
+  // is dropped
+  m_settleQueue->dropUnder(root);
+  m_ledger->forgetUnder(root);
+  m_logger.log("stopped monitoring " + root.string());
+}
 
-    m_logger.log("Polling on connections");
-    poll(pollFds.data(), 2, -1);
+void FoldersManager::dispatch(std::vector<fs::path> files) {
+  // one pass to bucket files by which settings handle them, which cmd and
+  // whether to keep
+  std::vector<std::vector<fs::path>> buckets(m_fileTypes.size());
+  for (auto &file : files) {
+    uint32_t fileType = m_fileTypes.find(file.native());
+    if (fileType != FileTypeTable::NotFound)
+      buckets[fileType].push_back(std::move(file));
+  }
 
-    if (pollFds[0].revents & POLLIN) {
-      // TODO split out main thread processing logic here, esp at switch
-      m_logger.log("Client message ready to read");
-      ServerCommands command; // prepare for reading from socket
+  // if we stop before they're run they stay queued in the ledger, and get
+  // picked up again next time
+  for (const auto &filteredFiles : buckets) {
+    m_ledger->advance(filteredFiles, ProcessQueued);
+  }
+  m_backupManager->flush();
 
-      int num = recv(m_clientSock, &command, sizeof(command), 0);
-      if (num < 0) {
-        m_logger.logErr("Failed at recv");
-        exit(EXIT_FAILURE);
-      }
-      if (num == 0) {
-        m_logger.log("Maybe err: received EOF from recv");
-      }
-      m_logger.log("Received value: " + std::to_string(command));
+  for (size_t i = 0; i < buckets.size(); ++i) {
+    std::vector<fs::path> &filteredFiles = buckets[i];
+    if (filteredFiles.empty())
+      continue;
 
-      handleMessage(m_clientSock, command);
-      close(m_clientSock);
+    const FileSettings &fileSetting = m_fileTypes.fileTypes()[i];
+    std::cout << "executing for extension:" << fileSetting.extension << "\n";
+    // parallel is a cmd per file, otherwise as few as fit in argv and the
+    // per cmd limits. Blocks if the executor is backed up, holding off the
+    // next scan
+    size_t maxFiles = fileSetting.parallel ? 1 : fileSetting.maxFilesPerCmd;
+    for (auto &chunk : chunkFileList(std::move(filteredFiles), fileSetting.cmd,
+                                     maxFiles, fileSetting.maxArgBytes)) {
+      m_executorPool->submit({fileSetting, std::move(chunk)});
     }
   }
 }
 
+void FoldersManager::queueNewFiles(const FolderScanner &scanner,
+                                   std::vector<fs::path> &newFiles) {
+  // new files wait until they stop changing before being processed
+  auto now = SettleQueue::Clock::now();
+  scanner.forEachNewFile(
+      [&](const fs::path &newFile, const FileFingerprint &fingerprint) {
+        std::cout << newFile << "\n";
+        m_settleQueue->add(newFile, fingerprint, now);
+        newFiles.push_back(newFile);
+      });
+}
+
+void FoldersManager::resumeUnfinished() {
+  std::vector<fs::path> unfinished = m_ledger->getUnfinished();
+  if (unfinished.empty())
+    return;
+  m_logger.log("resuming " + std::to_string(unfinished.size()) +
+               " unfinished files from last time");
+  // they've had the whole downtime to settle, but if one is being written
+  // again right now the queue will notice
+  auto now = SettleQueue::Clock::now();
+  for (const fs::path &file : unfinished) {
+    FileFingerprint fingerprint = getFingerprint(file);
+    if (fingerprint.isKnown() && m_fileTypes.contains(file.native()))
+      m_settleQueue->add(file, fingerprint, now);
+    else
+      m_ledger->forget(file); // gone, or no longer a type we handle
+  }
+}
+
+void FoldersManager::stop() {
+  quitThread();
+  // also releases the run thread if it's blocked on a full executor queue
+  m_executorPool->stop();
+  m_runThread.join();
+}
+
+void FoldersManager::serverStart() {
+  if (!m_controlServer->listen()) {
+    m_logger.logErr("Unable to start server on " + SocketAddr);
+    exit(EXIT_FAILURE);
+  }
+  m_logger.log("Waiting for connections");
+  m_controlServer->run();
+}
+
 void FoldersManager::serverStop() {
-  // TODO note we are just looping so just tidy up then exit
-  close(m_clientSock);
-  m_isServerRunning = false;
+  // answers already queued still go out, then run() returns
+  m_controlServer->stop();
   m_logger.log("Quitting from client request");
 }
 
-std::vector<fs::path> FoldersManager::getNewFiles() {
-  std::vector<fs::path> newFiles;
-  for (auto &folderAndScanner : m_trackedFoldersAndScanners) {
-    auto &scanner = folderAndScanner.second;
-    auto moreFiles = scanner.getNewFiles();
-    newFiles.insert(newFiles.end(), moreFiles.begin(), moreFiles.end());
+void FoldersManager::publishChange(const fs::path &file,
+                                   const LedgerEntry *entry, bool forgotten) {
+  if (!m_controlServer->hasSubscribers())
+    return;
+  std::string event(entry       ? processStateName(entry->state)
+                    : forgotten ? "forgotten"
+                                : "done");
+  event += "\t" + file.string() + "\t" +
+           std::to_string(entry ? entry->attempts : 0) + "\t" +
+           (entry ? entry->lastError : "");
+  m_controlServer->publish(event);
+}
+
+uint16_t FoldersManager::listFiles(std::string_view request,
+                                   std::string &out) {
+  Json filter = Json::object();
+  if (!request.empty())
+    filter = Json::parse(request, nullptr, false);
+  if (!filter.is_object()) {
+    out += "request isn't a json object";
+    return ResponseError;
   }
-  return newFiles;
+
+  std::string cursor;
+  size_t limit = DefaultListLimit;
+  std::string rootPrefix;
+  std::string extension;
+  std::optional<ProcessState> state;
+  try {
+    cursor = filter.value("cursor", "");
+    limit = std::clamp<size_t>(filter.value("limit", DefaultListLimit), 1,
+                               MaxListLimit);
+    if (filter.contains("root")) {
+      rootPrefix = normaliseDir(filter["root"].get<std::string>()).native();
+      if (!rootPrefix.ends_with(fs::path::preferred_separator))
+        rootPrefix += fs::path::preferred_separator;
+    }
+    extension = filter.value("extension", "");
+    if (filter.contains("state")) {
+      state = processStateFromName(filter["state"].get<std::string>());
+      if (!state) {
+        out += "unknown state " + filter["state"].get<std::string>();
+        return ResponseError;
+      }
+    }
+  } catch (const Json::exception &e) {
+    out += e.what();
+    return ResponseError;
+  }
+  // everything under root is together, no need to look before it
+  if (!rootPrefix.empty() && cursor < rootPrefix)
+    cursor = rootPrefix;
+
+  // cursor line goes first, filled in once we know where we stopped
+  size_t cursorAt = out.size();
+  size_t count = 0;
+  bool pastRoot = false;
+  std::string next = m_ledger->forEachEntryAfter(
+      cursor, ListScanBudget,
+      [&](std::string_view path, const LedgerEntry &entry) {
+        if (!rootPrefix.empty() && !path.starts_with(rootPrefix)) {
+          pastRoot = true;
+          return false;
+        }
+        if ((!extension.empty() && getExtension(path) != extension) ||
+            (state && entry.state != *state))
+          return true;
+        out += processStateName(entry.state);
+        out += '\t';
+        out += path;
+        out += '\n';
+        return ++count < limit;
+      });
+  if (pastRoot)
+    next.clear();
+  out.insert(cursorAt, next + '\n');
+  return ResponseOk;
 }
 
-void FoldersManager::handleMessage(int fd, ServerCommands command) {
+uint16_t FoldersManager::handleMessage(uint16_t command,
+                                       std::string_view payload, int client,
+                                       std::string &out) {
   switch (command) {
-  case ServerListFiles: {
-    // return a string of all new files
-    auto newFiles = getNewFiles();
-    std::string listFiles;
-    listFiles = std::accumulate(newFiles.begin(), newFiles.end(), listFiles,
-                                [](std::string str, const fs::path path) {
-                                  return str.append(path.string() + ",");
-                                });
-    listFiles.pop_back(); // remove last ','
-
-    sendString(fd, listFiles);
-    break;
+  case ServerListFiles:
+    return listFiles(payload, out);
+  case ServerListDeadLetters: {
+    // a line per file: path, attempts and the last error, tab separated
+    for (const auto &[file, entry] : m_ledger->getDeadLetters()) {
+      out += file.native();
+      out += '\t' + std::to_string(entry.attempts) + '\t';
+      out += entry.lastError;
+      out += '\n';
+    }
+    return ResponseOk;
+  }
+  case ServerSubscribe: {
+    // events start after this response, on the same connection
+    m_controlServer->subscribe(client);
+    return ResponseOk;
+  }
+  case ServerAddRoot:
+  case ServerRemoveRoot: {
+    fs::path root = normaliseDir(fs::path(payload));
+    std::error_code ec;
+    if (!root.is_absolute()) {
+      out += "root must be an absolute path";
+      return ResponseError;
+    }
+    if (command == ServerAddRoot && !fs::is_directory(root, ec)) {
+      out += root.string() + " is not a directory";
+      return ResponseError;
+    }
+    {
+      std::lock_guard<std::mutex> lock(m_rootChangesMutex);
+      m_rootChanges.emplace_back(root, command == ServerAddRoot);
+    }
+    m_eventQueue->notify();
+    out += (command == ServerAddRoot ? "adding " : "removing ") +
+           root.string() + "\n";
+    return ResponseOk;
   }
   case ServerQuit: {
-    std::string msg = "server quitting.\n";
-    sendString(fd, msg);
     serverStop();
-    break;
+    out += "server quitting.\n";
+    return ResponseOk;
   }
   default:
-    break;
+    out += std::to_string(command);
+    return ResponseUnknownCommand;
   }
 }
 
-void FoldersManager::loadFileTypes() {
+void FoldersManager::loadSettings() {
   SettingsManager settingsManager(m_fileTypeFile);
-  m_fileTypes = settingsManager.getFileSettings();
+  m_fileTypes = FileTypeTable(settingsManager.getFileSettings());
+  m_scanThreads = settingsManager.getScanThreads();
+  m_executorThreads = settingsManager.getExecutorThreads();
+  m_executorQueueSize = settingsManager.getExecutorQueueSize();
+  m_backupBackend = settingsManager.getBackupBackend();
+  m_changeDetection = settingsManager.getChangeDetection();
+  m_startupScan = settingsManager.getStartupScan();
+  m_eventLatency = settingsManager.getEventLatency();
+  m_settleSeconds = settingsManager.getSettleSeconds();
+  m_retryPolicy = settingsManager.getRetryPolicy();
 }
 
 void FoldersManager::quitThread() {
   // send stop to worker thread
   m_isRunning.store(false);
-  {
-    // signal scan to break guard
-    std::lock_guard<std::mutex> lock(doScanMutex);
-    doScan = true;
-    doScanCV.notify_all();
-  }
-}
-
-void sendString(int fd, std::string_view msg) {
-  // TODO implement similar loop as recvString in case send doesn't do all bytes
-  // (same return value as recv)
-  // send header
-  uint32_t strsize = msg.length();
-  if (send(fd, &strsize, sizeof(strsize), 0) == -1) {
-    std::cerr << "Failed to send() string size\n";
-  }
-  // send body
-  if (send(fd, msg.data(), msg.length(), 0) == -1) {
-    std::cerr << "Failed to send() string data\n";
-  }
-}
-
-std::string recvString(int fd) {
-  // read header
-  uint32_t strsize;
-  if (recv(fd, &strsize, sizeof(strsize), 0) != sizeof(strsize)) {
-    std::cerr << "Failed to recv() string size\n";
-  }
-  // read body
-  std::vector<char> buffer(strsize);
-  size_t charsReceived = 0;
-  size_t charsRemaining = strsize;
-  int res;
-  while (charsRemaining > 0) {
-    res = recv(fd, &buffer[charsReceived], charsRemaining, 0);
-    if (res == -1) {
-      std::cerr << "Failed to recv() string data\n";
-    } else if (res == 0) {
-      std::cerr
-          << "Socket closed connection before completed sending message\n";
-    } else {
-      // not all data yet received, keep going
-      // processed res bytes
-      charsReceived += res;
-      charsRemaining -= res;
-    }
-  }
-  std::string out(buffer.begin(), buffer.end());
-  return out;
+  m_eventQueue->notify();
 }
 
 FoldersManagerClient::FoldersManagerClient() : m_logger(STDOUT_FILENO) {}
@@ -593,14 +1051,14 @@ FoldersManagerClient::FoldersManagerClient() : m_logger(STDOUT_FILENO) {}
 FoldersManagerClient::~FoldersManagerClient() { disconnect(); }
 
 void FoldersManagerClient::connect() {
-  // main gateway to each function, re-establish connection. Makes streaming
-  // sockets easy to read to completion vs separating several commands+output
   struct sockaddr_un remoteAddr;
   remoteAddr.sun_family = AF_UNIX;
   strcpy(remoteAddr.sun_path, SocketAddr.c_str());
-  remoteAddr.sun_len =
-      sizeof(remoteAddr.sun_family) + strlen(remoteAddr.sun_path) + 1;
   // + 1 for null terminator
+  socklen_t remoteLen = SUN_LEN(&remoteAddr) + 1;
+#ifdef __APPLE__
+  remoteAddr.sun_len = remoteLen; // BSD only field
+#endif
 
   if ((m_sock = socket(AF_UNIX, SOCK_STREAM, 0)) == -1) {
     m_logger.logErr("client socket() call error");
@@ -609,7 +1067,7 @@ void FoldersManagerClient::connect() {
 
   // need global scope resolver for connect()
   if (::connect(m_sock, reinterpret_cast<sockaddr *>(&remoteAddr),
-                remoteAddr.sun_len) == -1) {
+                remoteLen) == -1) {
     m_logger.logErr("client connect() call error");
     exit(EXIT_FAILURE);
   }
@@ -617,44 +1075,95 @@ void FoldersManagerClient::connect() {
   m_logger.log("connected");
 }
 
-std::string FoldersManagerClient::getServerNewFiles() {
-  // TODO error handling if empty. When no files I saw total buffer overflow
-  // garbage
-
-  // gets a list of all monitored directories
-  connect();
-
-  sendCommand(ServerListFiles);
-
-  std::string out = recvString(m_sock);
-  disconnect();
-  return out;
+std::optional<std::string>
+FoldersManagerClient::request(ServerCommands command,
+                              std::string_view payload) {
+  if (m_sock == -1)
+    connect();
+  if (!sendFrame(m_sock, command, payload)) {
+    m_logger.logErr("send() error " + std::string(strerror(errno)) + "\n");
+    return std::nullopt;
+  }
+  std::optional<Frame> response = recvFrame(m_sock);
+  if (!response) {
+    // includes a server speaking another ProtocolVersion, which hangs up
+    m_logger.logErr("no response from server\n");
+    disconnect();
+    return std::nullopt;
+  }
+  if (response->type != ResponseOk) {
+    m_logger.logErr("server error " + std::to_string(response->type) + ": " +
+                    response->payload + "\n");
+    return std::nullopt;
+  }
+  return std::move(response->payload);
 }
 
-int FoldersManagerClient::sendCommand(ServerCommands command) {
-  int ret = send(m_sock, &command, sizeof(command), 0);
-  if (ret == -1) {
-    std::string error(strerror(errno));
-    m_logger.logErr("send() error " + error + "\n");
-  }
-  return ret;
+bool FoldersManagerClient::listFiles(
+    Json filter, const std::function<void(std::string_view)> &onFile) {
+  do {
+    std::optional<std::string> page = request(ServerListFiles, filter.dump());
+    if (!page)
+      return false;
+    // cursor line, then a line per file
+    std::string_view lines = *page;
+    size_t cursorEnd = lines.find('\n');
+    if (cursorEnd == std::string_view::npos) {
+      m_logger.logErr("malformed file list from server\n");
+      return false;
+    }
+    filter["cursor"] = std::string(lines.substr(0, cursorEnd));
+    lines.remove_prefix(cursorEnd + 1);
+    while (!lines.empty()) {
+      size_t lineEnd = lines.find('\n');
+      onFile(lines.substr(0, lineEnd));
+      lines.remove_prefix(lineEnd == std::string_view::npos ? lines.size()
+                                                            : lineEnd + 1);
+    }
+  } while (!filter["cursor"].get_ref<const std::string &>().empty());
+  return true;
 }
 
 std::string FoldersManagerClient::doServerQuit() {
   // tell server to quit and query response
-  connect();
+  return request(ServerQuit).value_or("");
+}
 
-  sendCommand(ServerQuit);
+std::string FoldersManagerClient::getServerDeadLetters() {
+  return request(ServerListDeadLetters).value_or("");
+}
 
-  std::string out = recvString(m_sock);
-  disconnect();
-  return out;
+std::string FoldersManagerClient::addServerRoot(const fs::path &root) {
+  return request(ServerAddRoot, fs::absolute(root).native()).value_or("");
+}
+
+std::string FoldersManagerClient::removeServerRoot(const fs::path &root) {
+  return request(ServerRemoveRoot, fs::absolute(root).native()).value_or("");
+}
+
+void FoldersManagerClient::subscribe(
+    const std::function<void(std::string_view)> &onEvent) {
+  if (!request(ServerSubscribe))
+    return;
+  while (m_sock != -1) {
+    std::optional<Frame> frame = recvFrame(m_sock);
+    if (!frame) {
+      m_logger.log("server closed the connection");
+      disconnect();
+    } else if (frame->type == ResponseEventsDropped) {
+      m_logger.logErr("missed " + frame->payload +
+                      " events, not reading them fast enough");
+    } else if (frame->type == ResponseEvent) {
+      onEvent(frame->payload);
+    }
+  }
 }
 
 void FoldersManagerClient::disconnect() {
-  // don't stop server, but tell it we are done and closing our connection so it
-  // waits for someone new
-  close(m_sock); // TODO add error or status check
+  // don't stop server, just hang up. It drops our connection and carries on
+  if (m_sock != -1)
+    close(m_sock);
+  m_sock = -1;
 }
 
 }; // namespace AN
@@ -1,13 +1,21 @@
 #pragma once
 #include "BackupManager.hpp"
-#include "Log.hpp"
-#include <CoreServices/CoreServices.h>
+#include "ControlServer.hpp"
+#include "EventSource.hpp"
+#include "FileIndex.hpp"
+#include "FileTypeTable.hpp"
+#include "log.hpp"
+#include <atomic>
 #include <filesystem>
+#include <map>
 #include <memory>
+#include <mutex>
 #include <span>
+#include <string_view>
 #include <sys/un.h>
 #include <thread>
 #include <unordered_map>
+#include <unordered_set>
 
 // AsciiNeuron - limit global vars scope
 namespace AN {
@@ -16,62 +24,157 @@ namespace fs = std::filesystem;
 // might not have write access outside parent folder due to apple...
 extern std::string SocketAddr;
 
-// get last modified time from file name
-time_t getFileTime(fs::path path);
+// lexically normal path without a trailing separator, so the same folder
+// always compares equal however it was spelled
+fs::path normaliseDir(const fs::path &dir);
 
 // checks if checkParent is the initial subset of child i.e. a parent to it
 bool isParentDir(const fs::path checkParent, const fs::path child);
 
-// recognized types, what exe to run, and whether to keep after processing
-struct FileSettings {
-  std::string extension;
-  fs::path cmd{"/bin/echo"};
-  bool keep{true};
+// how much of a folder touched by events needs scanning. A folder that comes
+// up more than once gets the most asked for
+enum DirtyScan : uint8_t {
+  // just the files directly inside
+  DirtyScanFiles,
+  // everything under it, but folders listed before whose DirStamp hasn't
+  // moved are skipped (new/moved in folders), see FolderScanner::scanChanged
+  DirtyScanChanged,
+  // everything under it listed again (dropped events), a file rewritten in
+  // place meanwhile doesn't move any stamp
+  DirtyScanFull,
 };
 
+// folders touched by events since the last scan -> how much of them to scan
+using DirtyDirs = std::map<fs::path, DirtyScan>;
+// files whose writer closed them since the last scan, see SettleQueue
+using ClosedFiles = std::unordered_set<fs::path>;
+
+// how much a FolderScanner whose root was in the backup looks at on startup
+enum StartupScan : uint8_t {
+  // every file, as if there was no backup
+  StartupScanFull,
+  // only folders whose DirStamp moved since, see FolderScanner::scanChanged.
+  // Misses files rewritten in place while we were down
+  StartupScanChanged,
+  // nothing, the event source replays everything since the backup's event id
+  StartupScanReplayed,
+};
+
+class DirectoryReader;
+class EventQueue;
+class ExecutorPool;
+class SettleQueue;
+
 class FolderScanner {
-  // TODO break down so FSEvents gives which specific sub folders changed. if so
-  // only scan those, not whole thing (only needed for subfolder)
 public:
   // don't scan yet since blocks callback? maybe actually ok
   // TODO separate out to precheck, do scan wait later
+  // indexes every file, there's no FileTypeTable to filter with
   explicit FolderScanner(fs::path directory);
-  explicit FolderScanner(fs::path directory, BackupManager *backupManager);
+  // only files fileTypes has a handler for are indexed, fileTypes must outlive
+  // the scanner. scanThreads > 1 walks the full scans in parallel, see
+  // DirectoryWalker. A root the backup has no folder stamps for is always
+  // scanned in full, whatever startupScan says. Files found new/updated since
+  // the backup make up the first batch, see forEachNewFile. Setting stop cuts
+  // that first scan short, leaving the scanner only good for throwing away.
+  // It's only looked at during the constructor
+  explicit FolderScanner(fs::path directory, BackupManager *backupManager,
+                         const FileTypeTable *fileTypes,
+                         unsigned scanThreads = 1,
+                         ChangeDetection changeDetection = ChangeMetadata,
+                         StartupScan startupScan = StartupScanFull,
+                         const std::atomic<bool> *stop = nullptr);
 
   int scan();
-  int scan(const fs::path subdir); // for FSEvents, if subdir is under dir root,
-                                   // just scan that part (speedup)
+  // for events, if subdir is under dir root just scan that part (speedup).
+  // See DirtyScan for how much of it depth covers
+  int scan(const fs::path subdir, DirtyScan depth = DirtyScanFull);
+  // forget last batch's new files, call before the scans for the next batch
+  void beginBatch();
 
-  std::vector<fs::path> getNewFiles() const;
-  std::vector<std::pair<fs::path, time_t>>
-  getFilesAndTimes() const; // get all files and their times
+  std::vector<fs::path> getNewFiles() const; // new/updated files in batch
+  // visit(path, fingerprint) for each of getNewFiles()
+  template <typename Visitor> void forEachNewFile(Visitor &&visit) const {
+    for (FileIndex::RecordId id : m_batchFiles) {
+      visit(m_files.getPath(id), m_files[id].fingerprint);
+    }
+  }
+  // visit(path, fingerprint) for every tracked file, without copying them
+  // all out
+  template <typename Visitor> void forEachFile(Visitor &&visit) const {
+    for (const FileRecord &record : m_files.records()) {
+      visit(m_files.getPath(record), record.fingerprint);
+    }
+  }
+  // visit(folder, stamp) for every folder listed in full so far
+  template <typename Visitor> void forEachDir(Visitor &&visit) const {
+    for (uint32_t id = 0; id < m_dirStamps.size(); ++id) {
+      if (m_dirStamps[id].isKnown())
+        visit(m_files.getDirPath(id), m_dirStamps[id]);
+    }
+  }
   fs::path getRoot() const;
 
 private:
   std::filesystem::path m_directoryRoot;
-  enum FileUpdateType { New, Updated, Old };
-  std::unordered_map<fs::path, std::pair<FileUpdateType, time_t>> m_files;
-  std::vector<std::string> m_filetypeFilter{{".flac"}, {".txt"}};
-  bool isValidExtension(const fs::directory_entry &entry);
+  FileIndex m_files;
+  // New/Updated since beginBatch()
+  std::vector<FileIndex::RecordId> m_batchFiles;
+  // by FileIndex folder id, unknown for folders never listed in full
+  std::vector<DirStamp> m_dirStamps;
+  // folder of the last scanned file, consecutive files mostly share it
+  fs::path m_lastDir;
+  uint32_t m_lastDirId{0};
+  const FileTypeTable *m_fileTypes{}; // nullptr to take everything
+  bool isValidExtension(std::string_view name) const;
+  unsigned m_scanThreads{1};
+  ChangeDetection m_changeDetection{ChangeMetadata};
+  const std::atomic<bool> *m_stop{}; // first scan only, see constructor
+  bool isStopping() const { return m_stop && m_stop->load(); }
   BackupManager
       *m_backupManager{}; // Managed by FoldersManager. Here just for restoring,
                           // Manager does writeout, querying me
   // internal function to do actual indexing starting at dir
-  int scanDir(const fs::path subdir);
-  void restoreContents(); // use BackupManager when first starting up
+  int scanDir(const fs::path subdir, bool recursive);
+  // name is a file (or anything but a folder) in dir, open as reader
+  void scanEntry(const fs::path &dir, const DirectoryReader &reader,
+                 const char *name);
+  void updateFile(const fs::path &path, FileFingerprint fingerprint);
+  uint32_t getDirId(const fs::path &dir);
+  // dir's files have all been recorded, as of stamp
+  void stampDir(const fs::path &dir, DirStamp stamp);
+  // use BackupManager when first starting up. False if it had nothing for
+  // this root
+  bool restoreContents();
+  // everything indexed so far into the BackupManager
+  void backupContents();
+  // relist just the folders at or under topDirId whose stamp has moved (or
+  // was never taken), and everything under new folders found in them. A
+  // stat per folder rather than per file
+  void scanChanged(uint32_t topDirId);
 };
 
-enum ServerCommands {
+// sent as a request frame's type, see ControlServer.hpp. Only ever add to
+// the end, older clients send the old numbers
+enum ServerCommands : uint16_t {
+  // a page of ledger entries in path order. Request payload is an optional
+  // json object of filters, see FoldersManagerClient::listFiles, plus the
+  // "cursor" to carry on from. Response is the next cursor (empty when
+  // done) on the first line, then a "state\tpath" line per entry
   ServerListFiles,
   ServerQuit,
+  ServerListDeadLetters, // files whose cmd failed every retry
+  // stream ledger changes as ResponseEvents from then on, see
+  // FoldersManager::publishChange
+  ServerSubscribe,
+  // start/stop watching the folder whose absolute path is the payload, the
+  // other roots carry on undisturbed. A new root's first scan happens in the
+  // background, the response doesn't wait for it
+  ServerAddRoot,
+  ServerRemoveRoot,
   ServerCommandsCount
 }; // implement in foldermanager server and separate client
 
-// sends formatted { uint32_t len, char *data } data to valid ready socket at fd
-void sendString(int fd, std::string_view str);
-// parses data from sendString into valid std::string
-std::string recvString(int fd);
-
 class FoldersManager {
 public:
   // call this one to temporarily run at input folders:
@@ -81,17 +184,17 @@ public:
                     // later
   ~FoldersManager();
 
+  // before run(), ServerAddRoot once running
   void addFolders(std::span<fs::path> folderNames);
 
   void run();
   void stop();
+  // answer clients on the control socket until one sends ServerQuit, blocks
   void serverStart();
   void serverStop();
 
-  std::vector<fs::path>
-  getNewFiles(); // returns list of new files in last batch
-
-  FSEventStreamEventId getLatestEventId() { return m_latestEventId; }
+  EventId getLatestEventId() { return m_latestEventId; }
+  const ProcessingLedger &getLedger() const { return *m_ledger; }
 
 private:
   // need to handle e.g. ctrl z signal to know to put it in background and write
@@ -99,34 +202,98 @@ private:
   Log::Logger m_logger;
   std::unique_ptr<BackupManager> m_backupManager;
 
-  // for server use, client FoldersManagerClient has own copy
-  int m_serverSock;
-  int m_clientSock;
-  // to start/stop network thread
-  bool m_isServerRunning{false};
+  // for server use, client FoldersManagerClient has own copy. Exists from
+  // the start so there's always somewhere to publish to, only listens once
+  // serverStart() is called
+  std::unique_ptr<ControlServer> m_controlServer;
 
   std::atomic_bool m_isRunning{false};
   std::thread m_runThread{};
   std::thread m_serverThread{};
-  FSEventStreamRef m_stream{nullptr};
-  FSEventStreamEventId m_latestEventId;
-  dispatch_queue_t m_queue{nullptr};
+  // FSEvents or inotify depending on platform, see EventSource.hpp
+  std::unique_ptr<EventSource> m_eventSource;
+  // m_eventSource's thread -> run thread
+  std::unique_ptr<EventQueue> m_eventQueue;
+  // last event scanned, where the next startup replays from
+  EventId m_latestEventId{EventIdSinceNow};
   // this keeps them unique and easily tracked together:
   std::unordered_map<fs::path, FolderScanner> m_trackedFoldersAndScanners;
-  std::vector<FileSettings> m_fileTypes;
+  // root -> true to add, false to remove, from the server for the run thread
+  std::mutex m_rootChangesMutex; // this and m_scannedRoots
+  std::vector<std::pair<fs::path, bool>> m_rootChanges;
+  // added roots whose first scan is done, waiting for the run thread
+  std::vector<std::pair<fs::path, FolderScanner>> m_scannedRoots;
+  // added roots still having their first scan, run thread only
+  struct PendingRoot {
+    std::thread scanThread;
+    DirtyDirs dirtyDirs; // events under it meanwhile, scanned once it's in
+    bool isRemoved{false}; // removed again before it finished
+    // set when removed or quitting, so a big scan doesn't have to finish
+    std::atomic<bool> stopScan{false};
+  };
+  std::map<fs::path, PendingRoot> m_pendingRoots;
+  // shared with every FolderScanner, so fixed once they exist
+  FileTypeTable m_fileTypes;
+  unsigned m_scanThreads{1}; // for each FolderScanner's full scans
+  ChangeDetection m_changeDetection{ChangeMetadata};
+  // for roots restored from the backup, replayed instead where possible
+  StartupScan m_startupScan{StartupScanChanged};
+  unsigned m_executorThreads{1};
+  size_t m_executorQueueSize{1};
+  std::string m_backupBackend{"json"}; // see makeBackupManager
+  double m_eventLatency{3.0};          // seconds, see makeEventSource
+  double m_settleSeconds{2.0};         // quiet window, see SettleQueue
+  RetryPolicy m_retryPolicy;
+  // new files wait here until they're done being written
+  std::unique_ptr<SettleQueue> m_settleQueue;
+  // what each found file is up to, so a restart only redoes unfinished work.
+  // Before m_executorPool, whose threads report to it
+  std::unique_ptr<ProcessingLedger> m_ledger;
+  // runs the cmds for new files, so the run thread can go back to scanning
+  std::unique_ptr<ExecutorPool> m_executorPool;
 
   fs::path m_logFile{
       "musicmonitorbackup"}; // where to load/save latest event id etc
   fs::path m_fileTypeFile{"filetype_settings.json"}; // where to source SettingsManager from
 
   void quitThread();
-  // thread will be waiting for read(), handle and process it here depending on
-  // the specific ServerCommand
-  // fd is socket of connection to reply to
-  void handleMessage(int fd, ServerCommands command);
+  // answer a request from a client, on the server's thread so mustn't wait
+  // on the run thread
+  uint16_t handleMessage(uint16_t command, std::string_view payload,
+                         int client, std::string &out);
+  // ServerListFiles, a page of ledger entries. See FoldersManagerClient
+  uint16_t listFiles(std::string_view request, std::string &out);
+  // tell subscribers about a ledger change, as a tab separated line of state
+  // name, path, attempts and last error. Once entry is nullptr the state is
+  // "done", or "forgotten" if it was dropped without its cmd succeeding (file
+  // deleted, root removed etc)
+  void publishChange(const fs::path &file, const LedgerEntry *entry,
+                     bool forgotten);
   void quitEventStream();
   void createEventStream();
-  void loadFileTypes(); // set up m_fileTypes data
+  // called from the EventSource thread with each batch of changes
+  void handleEvents(std::span<const FileEvent> events);
+  // run thread, what the events mean needs scanning
+  void collectEvents(std::span<const FileEvent> events, DirtyDirs &dirtyDirs,
+                     ClosedFiles &closedFiles);
+  void loadSettings(); // set up m_fileTypes etc from m_fileTypeFile
+  // put the ledger's unfinished files from last time back through the settle
+  // queue, run thread
+  void resumeUnfinished();
+  // scanner's new/updated files into the settle queue, and onto newFiles for
+  // the ledger, run thread
+  void queueNewFiles(const FolderScanner &scanner,
+                     std::vector<fs::path> &newFiles);
+  // hand files to the executor grouped by file type, run thread. Blocks if
+  // the executor is backed up
+  void dispatch(std::vector<fs::path> files);
+  // run thread, act on m_rootChanges and take in finished first scans, whose
+  // held back events go in dirtyDirs
+  void applyRootChanges(DirtyDirs &dirtyDirs);
+  void addRoot(const fs::path &root);
+  void removeRoot(const fs::path &root);
+  // root's first scan on pending's thread, into m_scannedRoots once done
+  void startFirstScan(const fs::path &root, PendingRoot &pending);
 };
 
 class FoldersManagerClient {
@@ -134,16 +301,31 @@ public:
   FoldersManagerClient();
   ~FoldersManagerClient();
 
-  std::string getServerNewFiles();
+  // every ledger entry matching filter, a page at a time, handing each
+  // "state\tpath" line to onFile. filter can have "root", "extension" (eg
+  // ".flac") and "state" (see processStateName) to match, and "limit" for
+  // the page size. False if the listing stopped short, see the log
+  bool listFiles(Json filter,
+                 const std::function<void(std::string_view)> &onFile);
   std::string doServerQuit();
+  std::string getServerDeadLetters();
+  // root is made absolute here, the server's working dir may differ
+  std::string addServerRoot(const fs::path &root);
+  std::string removeServerRoot(const fs::path &root);
+  // hand each event to onEvent as it comes, until the server goes away
+  void subscribe(const std::function<void(std::string_view)> &onEvent);
 
 private:
   std::unique_ptr<BackupManager> m_backupManager{nullptr};
   Log::Logger m_logger;
-  int m_sock;
+  // kept open across requests, connected on the first one
+  int m_sock{-1};
   void connect();
   void disconnect();
-  int sendCommand(ServerCommands command); // convenience wrapper
+  // send command and wait for its response's payload. nullopt on any error,
+  // logged
+  std::optional<std::string> request(ServerCommands command,
+                                     std::string_view payload = {});
 };
 
 } // namespace AN
@@ -0,0 +1,306 @@
+#include "JournalManager.hpp"
+#include "FoldersManager.hpp"
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <fcntl.h>
+#include <fstream>
+#include <iostream>
+#include <unistd.h>
+
+namespace AN {
+
+// compact once the journal has this many lines more than there are files
+constexpr size_t CompactMinRecords = 64 * 1024;
+// write the snapshot out in chunks of about this much
+constexpr size_t SnapshotChunkSize = 1 << 20;
+
+JournalManager::JournalManager(fs::path backupFile, size_t syncBatch)
+    : m_snapshotFile(backupFile.string() + ".snapshot"),
+      m_journalFile(backupFile.string() + ".journal"),
+      m_syncBatch(std::max<size_t>(syncBatch, 1)) {
+  bool isClean = true;
+  replay(m_snapshotFile, isClean);
+  m_journalRecords = replay(m_journalFile, isClean);
+
+  m_journalFd = open(m_journalFile.c_str(),
+                     O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+  if (m_journalFd == -1) {
+    std::cerr << "Failed to open backup journal " << m_journalFile << ": "
+              << strerror(errno) << "\n";
+    return;
+  }
+  if (!isClean) {
+    // anything appended after a torn line would be unreadable next time, so
+    // start over from what we did manage to read
+    std::lock_guard<std::mutex> lock(m_mutex);
+    compact();
+  }
+}
+
+JournalManager::~JournalManager() {
+  std::lock_guard<std::mutex> lock(m_mutex);
+  writePending(true);
+  if (m_journalFd != -1)
+    close(m_journalFd);
+}
+
+size_t JournalManager::replay(const fs::path &file, bool &isClean) {
+  std::ifstream in(file);
+  if (!in)
+    return 0;
+
+  size_t lines = 0;
+  std::string line;
+  while (std::getline(in, line)) {
+    if (line.empty())
+      continue;
+    try {
+      apply(Json::parse(line));
+    } catch (const Json::exception &e) {
+      // most likely cut off mid write by a crash, nothing after it is trusted
+      std::cerr << "Stopping replay of " << file << " at damaged line "
+                << lines + 1 << ": " << e.what() << "\n";
+      isClean = false;
+      break;
+    }
+    ++lines;
+  }
+  return lines;
+}
+
+void JournalManager::apply(const Json &record) {
+  if (record.contains("last_event_id")) {
+    m_lastEventId = record["last_event_id"].template get<EventId>();
+    return;
+  }
+  if (record.contains("ledger")) {
+    std::string path = record["ledger"].template get<std::string>();
+    if (record.value("state", "") == processStateName(ProcessDone))
+      m_ledger.erase(path);
+    else
+      m_ledger.insert_or_assign(std::move(path), ledgerEntryFromJson(record));
+    return;
+  }
+  if (record.contains("dir")) {
+    std::string root = record["root"].template get<std::string>();
+    std::string dir = record["dir"].template get<std::string>();
+    DirStamp stamp = dirStampFromJson(record);
+    if (stamp.isKnown()) {
+      m_rootDirs[std::move(root)][std::move(dir)] = stamp;
+    } else if (auto rootDirs = m_rootDirs.find(root);
+               rootDirs != m_rootDirs.end()) {
+      rootDirs->second.erase(dir); // to be listed again
+    }
+    return;
+  }
+  m_rootFiles[record["root"].template get<std::string>()]
+             [record["path"].template get<std::string>()] =
+                 fingerprintFromJson(record);
+}
+
+void JournalManager::append(const Json &record) {
+  apply(record);
+  m_pending += record.dump();
+  m_pending += '\n';
+  if (++m_pendingRecords >= m_syncBatch)
+    writePending(true);
+}
+
+void JournalManager::writePending(bool sync) {
+  if (m_journalFd == -1) {
+    // already complained when opening, nowhere to put these
+    m_pending.clear();
+    m_pendingRecords = 0;
+    return;
+  }
+
+  if (!m_pending.empty()) {
+    if (writeAll(m_journalFd, m_pending)) {
+      m_journalRecords += m_pendingRecords;
+    } else {
+      std::cerr << "Failed to write backup journal: " << strerror(errno)
+                << "\n";
+    }
+    m_pending.clear();
+    m_pendingRecords = 0;
+  }
+  if (sync && fsync(m_journalFd) == -1) {
+    std::cerr << "Failed to fsync backup journal: " << strerror(errno)
+              << "\n";
+  }
+
+  size_t fileCount = m_ledger.size();
+  for (const auto &rootFiles : m_rootFiles) {
+    fileCount += rootFiles.second.size();
+  }
+  for (const auto &rootDirs : m_rootDirs) {
+    fileCount += rootDirs.second.size();
+  }
+  if (m_journalRecords > std::max(CompactMinRecords, fileCount))
+    compact();
+}
+
+void JournalManager::compact() {
+  fs::path tmpFile = m_snapshotFile.string() + ".tmp";
+  int fd = open(tmpFile.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC,
+                0644);
+  if (fd == -1) {
+    std::cerr << "Failed to open " << tmpFile << ": " << strerror(errno)
+              << "\n";
+    return;
+  }
+
+  bool ok = true;
+  std::string buffer;
+  if (m_lastEventId != EventIdSinceNow) {
+    buffer += Json{{"last_event_id", m_lastEventId}}.dump() + "\n";
+  }
+  for (const auto &[root, files] : m_rootFiles) {
+    for (const auto &[path, fingerprint] : files) {
+      Json record{{"root", root}, {"path", path}};
+      fingerprintToJson(fingerprint, record);
+      buffer += record.dump();
+      buffer += '\n';
+      if (buffer.size() >= SnapshotChunkSize) {
+        ok = ok && writeAll(fd, buffer);
+        buffer.clear();
+      }
+    }
+  }
+  for (const auto &[root, dirs] : m_rootDirs) {
+    for (const auto &[dir, stamp] : dirs) {
+      Json record{{"root", root}, {"dir", dir}};
+      dirStampToJson(stamp, record);
+      buffer += record.dump();
+      buffer += '\n';
+      if (buffer.size() >= SnapshotChunkSize) {
+        ok = ok && writeAll(fd, buffer);
+        buffer.clear();
+      }
+    }
+  }
+  for (const auto &[path, entry] : m_ledger) {
+    Json record{{"ledger", path}};
+    ledgerEntryToJson(entry, record);
+    buffer += record.dump();
+    buffer += '\n';
+    if (buffer.size() >= SnapshotChunkSize) {
+      ok = ok && writeAll(fd, buffer);
+      buffer.clear();
+    }
+  }
+  ok = ok && writeAll(fd, buffer) && fsync(fd) == 0;
+  close(fd);
+
+  std::error_code ec;
+  if (!ok) {
+    std::cerr << "Failed to write backup snapshot: " << strerror(errno)
+              << "\n";
+    fs::remove(tmpFile, ec);
+    return;
+  }
+  // atomic swap, a crash either side leaves a snapshot + journal that replay
+  // to the same state
+  fs::rename(tmpFile, m_snapshotFile, ec);
+  if (ec) {
+    std::cerr << "Failed to replace backup snapshot: " << ec.message() << "\n";
+    return;
+  }
+
+  // snapshot holds everything now, journal can start over
+  if (ftruncate(m_journalFd, 0) == -1 || fsync(m_journalFd) == -1) {
+    std::cerr << "Failed to truncate backup journal: " << strerror(errno)
+              << "\n";
+    return;
+  }
+  m_journalRecords = 0;
+}
+
+EventId JournalManager::getLastObservedEventId() {
+  std::lock_guard<std::mutex> lock(m_mutex);
+  return m_lastEventId;
+}
+
+bool JournalManager::isMonitoredRoot(fs::path path) {
+  std::lock_guard<std::mutex> lock(m_mutex);
+  return m_rootFiles.contains(path.string()) ||
+         m_rootDirs.contains(path.string());
+}
+
+std::vector<std::pair<fs::path, FileFingerprint>>
+JournalManager::getRootMonitoredFiles(fs::path path) {
+  std::lock_guard<std::mutex> lock(m_mutex);
+  std::vector<std::pair<fs::path, FileFingerprint>> pathsAndTimes;
+  auto rootFiles = m_rootFiles.find(path.string());
+  if (rootFiles == m_rootFiles.end())
+    return pathsAndTimes;
+
+  pathsAndTimes.reserve(rootFiles->second.size());
+  for (const auto &[file, fingerprint] : rootFiles->second) {
+    pathsAndTimes.emplace_back(file, fingerprint);
+  }
+  return pathsAndTimes;
+}
+
+void JournalManager::forEachRootDir(
+    const fs::path &root,
+    const std::function<void(std::string_view, const DirStamp &)> &visit) {
+  std::lock_guard<std::mutex> lock(m_mutex);
+  auto rootDirs = m_rootDirs.find(root.string());
+  if (rootDirs == m_rootDirs.end())
+    return;
+  for (const auto &[dir, stamp] : rootDirs->second) {
+    visit(dir, stamp);
+  }
+}
+
+void JournalManager::getFolderManagerUpdate(FoldersManager &manager) {
+  std::lock_guard<std::mutex> lock(m_mutex);
+  append(Json{{"last_event_id", manager.getLatestEventId()}});
+}
+
+void JournalManager::updateBackup() { flush(); }
+
+void JournalManager::fileUpdated(const fs::path &root, const fs::path &path,
+                                 const FileFingerprint &fingerprint) {
+  std::lock_guard<std::mutex> lock(m_mutex);
+  Json record{{"root", root.string()}, {"path", path.string()}};
+  fingerprintToJson(fingerprint, record);
+  append(record);
+}
+
+void JournalManager::dirUpdated(const fs::path &root, const fs::path &dir,
+                                const DirStamp &stamp) {
+  std::lock_guard<std::mutex> lock(m_mutex);
+  Json record{{"root", root.string()}, {"dir", dir.string()}};
+  dirStampToJson(stamp, record);
+  append(record);
+}
+
+void JournalManager::forEachLedgerEntry(
+    const std::function<void(std::string_view, const LedgerEntry &)> &visit) {
+  std::lock_guard<std::mutex> lock(m_mutex);
+  for (const auto &[path, entry] : m_ledger) {
+    visit(path, entry);
+  }
+}
+
+void JournalManager::ledgerUpdated(const fs::path &path,
+                                   const LedgerEntry *entry) {
+  std::lock_guard<std::mutex> lock(m_mutex);
+  Json record{{"ledger", path.string()}};
+  if (entry)
+    ledgerEntryToJson(*entry, record);
+  else
+    record["state"] = processStateName(ProcessDone);
+  append(record);
+}
+
+void JournalManager::flush() {
+  std::lock_guard<std::mutex> lock(m_mutex);
+  writePending(true);
+}
+
+} // namespace AN
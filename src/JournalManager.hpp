@@ -0,0 +1,85 @@
+#pragma once
+#include "BackupManager.hpp"
+#include <filesystem>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+
+namespace AN {
+namespace fs = std::filesystem;
+
+// write ahead journal backup. Each file change is appended as it happens as
+// one json object per line, eg
+//   {"root": "str", "path": "str", "mtime_ns": num, "size": num, ...}
+//   {"root": "str", "dir": "str", "mtime_ns": num, "inode": num, ...}
+//   {"last_event_id": num}
+//   {"ledger": "path", "state": "str", "attempts": num, "error": "str"}
+// (state "done" dropping the file's ledger entry)
+// and fsynced in batches, so a crash loses at most the unsynced tail. Once
+// the journal outgrows the state it describes, the state is compacted into a
+// snapshot file (same line format) and the journal starts over. Startup
+// replays snapshot then journal. Files live next to backupFile as
+// <backupFile>.snapshot and <backupFile>.journal
+class JournalManager : public BackupManager {
+public:
+  // fsync every syncBatch records even if nobody calls flush()
+  JournalManager(fs::path backupFile, size_t syncBatch = 1024);
+  ~JournalManager();
+
+  EventId getLastObservedEventId() override;
+
+  bool isMonitoredRoot(fs::path path) override;
+
+  std::vector<std::pair<fs::path, FileFingerprint>>
+  getRootMonitoredFiles(fs::path path) override;
+  void forEachRootDir(
+      const fs::path &root,
+      const std::function<void(std::string_view, const DirStamp &)> &visit)
+      override;
+
+  void getFolderManagerUpdate(FoldersManager &manager) override;
+  // nothing to do, changes were journalled as they happened
+  void getFolderScannerUpdate(FolderScanner &) override {};
+  void updateBackup() override;
+
+  void fileUpdated(const fs::path &root, const fs::path &path,
+                   const FileFingerprint &fingerprint) override;
+  void dirUpdated(const fs::path &root, const fs::path &dir,
+                  const DirStamp &stamp) override;
+  void flush() override;
+
+  void forEachLedgerEntry(
+      const std::function<void(std::string_view, const LedgerEntry &)> &visit)
+      override;
+  void ledgerUpdated(const fs::path &path, const LedgerEntry *entry) override;
+
+private:
+  fs::path m_snapshotFile;
+  fs::path m_journalFile;
+  int m_journalFd{-1};
+  size_t m_syncBatch;
+
+  std::mutex m_mutex; // everything below
+  std::string m_pending; // lines not yet written out
+  size_t m_pendingRecords{0};
+  size_t m_journalRecords{0}; // lines in the journal file
+  // replayed + live state, what a compaction writes out
+  EventId m_lastEventId{EventIdSinceNow};
+  std::unordered_map<std::string,
+                     std::unordered_map<std::string, FileFingerprint>>
+      m_rootFiles;
+  std::unordered_map<std::string, std::unordered_map<std::string, DirStamp>>
+      m_rootDirs;
+  std::unordered_map<std::string, LedgerEntry> m_ledger;
+
+  // returns lines read, stops at the first damaged one (torn write) and
+  // clears isClean
+  size_t replay(const fs::path &file, bool &isClean);
+  void apply(const Json &record);
+  void append(const Json &record);
+  // m_mutex must be held for these
+  void writePending(bool sync);
+  void compact();
+};
+
+} // namespace AN
@@ -0,0 +1,431 @@
+#include "Process.hpp"
+
+#include <algorithm>
+#include <array>
+#include <cerrno>
+#include <csignal>
+#include <cstring>
+#include <fcntl.h>
+#include <poll.h>
+#include <spawn.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include <vector>
+
+extern char **environ;
+
+namespace AN {
+
+// how long a timed out child gets between SIGTERM and SIGKILL
+constexpr std::chrono::milliseconds KillGracePeriod{2000};
+// how often runProcess checks whether the child has exited, which its pipes
+// closing doesn't say either way
+constexpr std::chrono::milliseconds ExitPollInterval{20};
+
+// close on exec so children spawned concurrently by other executor threads
+// don't hold our pipes open
+static bool makePipe(int fds[2]) {
+#ifdef __linux__
+  return pipe2(fds, O_CLOEXEC) == 0;
+#else
+  if (pipe(fds) == -1)
+    return false;
+  fcntl(fds[0], F_SETFD, FD_CLOEXEC);
+  fcntl(fds[1], F_SETFD, FD_CLOEXEC);
+  return true;
+#endif
+}
+
+std::string ProcessResult::describe() const {
+  if (!spawned)
+    return "failed to start: " + error;
+  if (timedOut)
+    return "timed out and was killed";
+  if (signal)
+    return "killed by signal " + std::to_string(signal);
+  if (!error.empty())
+    return error;
+  return "exited with code " + std::to_string(exitCode);
+}
+
+// posix_spawn command with args, stdin from stdinFd (or /dev/null if -1) and
+// stdout/stderr to the given fds (left as ours if -1). 0 or the errno
+static int spawnChild(const fs::path &command,
+                      std::span<const std::string> args, int stdinFd,
+                      int stdoutFd, int stderrFd, pid_t &pid) {
+  posix_spawn_file_actions_t actions;
+  posix_spawn_file_actions_init(&actions);
+  // dup2 clears close on exec for the child's copy
+  if (stdinFd == -1) {
+    posix_spawn_file_actions_addopen(&actions, STDIN_FILENO, "/dev/null",
+                                     O_RDONLY, 0);
+  } else {
+    posix_spawn_file_actions_adddup2(&actions, stdinFd, STDIN_FILENO);
+  }
+  if (stdoutFd != -1)
+    posix_spawn_file_actions_adddup2(&actions, stdoutFd, STDOUT_FILENO);
+  if (stderrFd != -1)
+    posix_spawn_file_actions_adddup2(&actions, stderrFd, STDERR_FILENO);
+
+  // don't pass on whatever signal setup the daemon has
+  posix_spawnattr_t attr;
+  posix_spawnattr_init(&attr);
+  sigset_t emptyMask;
+  sigemptyset(&emptyMask);
+  posix_spawnattr_setsigmask(&attr, &emptyMask);
+  sigset_t defaultSignals;
+  sigemptyset(&defaultSignals);
+  sigaddset(&defaultSignals, SIGPIPE);
+  sigaddset(&defaultSignals, SIGINT);
+  posix_spawnattr_setsigdefault(&attr, &defaultSignals);
+  short flags = POSIX_SPAWN_SETSIGMASK | POSIX_SPAWN_SETSIGDEF;
+#ifdef POSIX_SPAWN_USEVFORK
+  // older glibc only takes the vfork path when asked
+  flags |= POSIX_SPAWN_USEVFORK;
+#endif
+  posix_spawnattr_setflags(&attr, flags);
+
+  std::vector<char *> argv;
+  argv.push_back(const_cast<char *>(command.c_str()));
+  for (const auto &arg : args) {
+    argv.push_back(const_cast<char *>(arg.c_str()));
+  }
+  argv.push_back(nullptr);
+
+  int spawnErr = posix_spawn(&pid, command.c_str(), &actions, &attr,
+                             argv.data(), environ);
+  posix_spawn_file_actions_destroy(&actions);
+  posix_spawnattr_destroy(&attr);
+  return spawnErr;
+}
+
+static void setExitStatus(int status, ProcessResult &result) {
+  if (WIFEXITED(status)) {
+    result.exitCode = WEXITSTATUS(status);
+  } else if (WIFSIGNALED(status)) {
+    result.signal = WTERMSIG(status);
+  }
+}
+
+// reap pid into result's exitCode/signal
+static void waitChild(pid_t pid, ProcessResult &result) {
+  int status;
+  while (waitpid(pid, &status, 0) == -1) {
+    if (errno != EINTR) {
+      result.error = "waitpid() error: " + std::string(strerror(errno));
+      return;
+    }
+  }
+  setExitStatus(status, result);
+}
+
+// as waitChild if pid has exited, false if it's still running
+static bool tryReapChild(pid_t pid, ProcessResult &result) {
+  int status;
+  pid_t reaped;
+  while ((reaped = waitpid(pid, &status, WNOHANG)) == -1) {
+    if (errno != EINTR) {
+      result.error = "waitpid() error: " + std::string(strerror(errno));
+      return true; // nothing left to wait for
+    }
+  }
+  if (reaped == 0)
+    return false;
+  setExitStatus(status, result);
+  return true;
+}
+
+ProcessResult runProcess(const fs::path &command,
+                         std::span<const std::string> args,
+                         std::chrono::milliseconds timeout, size_t maxOutput) {
+  using Clock = std::chrono::steady_clock;
+  ProcessResult result;
+
+  int outPipe[2];
+  int errPipe[2];
+  if (!makePipe(outPipe)) {
+    result.error = "pipe() error: " + std::string(strerror(errno));
+    return result;
+  }
+  if (!makePipe(errPipe)) {
+    result.error = "pipe() error: " + std::string(strerror(errno));
+    close(outPipe[0]);
+    close(outPipe[1]);
+    return result;
+  }
+
+  pid_t pid;
+  int spawnErr = spawnChild(command, args, -1, outPipe[1], errPipe[1], pid);
+  // only the child writes, so we see EOF once it (and its children) exit
+  close(outPipe[1]);
+  close(errPipe[1]);
+  if (spawnErr != 0) {
+    result.error = "posix_spawn() error: " + std::string(strerror(spawnErr));
+    close(outPipe[0]);
+    close(errPipe[0]);
+    return result;
+  }
+  result.spawned = true;
+
+  std::array<struct pollfd, 2> pollFds;
+  pollFds[0].fd = outPipe[0];
+  pollFds[1].fd = errPipe[0];
+  std::array<std::string *, 2> outputs{&result.out, &result.err};
+  for (auto &pollFd : pollFds) {
+    pollFd.events = POLLIN;
+    fcntl(pollFd.fd, F_SETFL, fcntl(pollFd.fd, F_GETFL) | O_NONBLOCK);
+  }
+
+  bool hasDeadline = timeout > std::chrono::milliseconds::zero();
+  Clock::time_point deadline = Clock::now() + timeout;
+  char buffer[4096];
+  // everything available from pipe i, closed once it hits EOF
+  auto readPipe = [&](size_t i) {
+    ssize_t num;
+    while ((num = read(pollFds[i].fd, buffer, sizeof(buffer))) > 0) {
+      std::string &output = *outputs[i];
+      if (output.size() < maxOutput) {
+        output.append(buffer, std::min<size_t>(num, maxOutput - output.size()));
+      }
+    }
+    if (num == 0 || (errno != EAGAIN && errno != EINTR)) {
+      close(pollFds[i].fd);
+      pollFds[i].fd = -1;
+    }
+  };
+
+  // the child exiting is what counts, not its pipes. It can close them and
+  // carry on, or leave a background child of its own holding them open
+  bool exited = false;
+  // with both pipes closed it's most likely exiting, so look again soon,
+  // backing off in case it isn't
+  int64_t closedWaitMs = 1;
+  while (!exited) {
+    int64_t waitMs = ExitPollInterval.count();
+    if (pollFds[0].fd == -1 && pollFds[1].fd == -1) {
+      waitMs = closedWaitMs;
+      closedWaitMs = std::min(closedWaitMs * 2, ExitPollInterval.count());
+    }
+    if (hasDeadline) {
+      auto remaining = std::chrono::duration_cast<std::chrono::milliseconds>(
+          deadline - Clock::now());
+      if (remaining <= std::chrono::milliseconds::zero()) {
+        if (!result.timedOut) {
+          // ask nicely first, then give it a little while to clean up
+          result.timedOut = true;
+          kill(pid, SIGTERM);
+          deadline = Clock::now() + KillGracePeriod;
+          continue;
+        }
+        kill(pid, SIGKILL);
+        break;
+      }
+      waitMs = std::min(waitMs, remaining.count());
+    }
+
+    // fds of -1 are skipped, so with both pipes finished this just sleeps
+    if (poll(pollFds.data(), pollFds.size(), static_cast<int>(waitMs)) == -1) {
+      if (errno == EINTR)
+        continue;
+      result.error = "poll() error: " + std::string(strerror(errno));
+      kill(pid, SIGKILL);
+      break;
+    }
+    for (size_t i = 0; i < pollFds.size(); ++i) {
+      if (pollFds[i].fd != -1 && pollFds[i].revents)
+        readPipe(i);
+    }
+    exited = tryReapChild(pid, result);
+  }
+
+  for (size_t i = 0; i < pollFds.size(); ++i) {
+    // whatever it wrote before exiting, anything a background child writes
+    // later is dropped
+    if (exited && pollFds[i].fd != -1)
+      readPipe(i);
+    if (pollFds[i].fd != -1)
+      close(pollFds[i].fd);
+  }
+  // killed, so this doesn't block for long
+  if (!exited)
+    waitChild(pid, result);
+  return result;
+}
+
+CoProcess::CoProcess(fs::path command) : m_command(std::move(command)) {}
+
+CoProcess::~CoProcess() { stop(nullptr, false); }
+
+bool CoProcess::start(ProcessResult &result) {
+  int inPipe[2];
+  int outPipe[2];
+  if (!makePipe(inPipe)) {
+    result.error = "pipe() error: " + std::string(strerror(errno));
+    return false;
+  }
+  if (!makePipe(outPipe)) {
+    result.error = "pipe() error: " + std::string(strerror(errno));
+    close(inPipe[0]);
+    close(inPipe[1]);
+    return false;
+  }
+
+  // stderr stays ours, so its complaints end up in our log
+  int spawnErr =
+      spawnChild(m_command, {}, inPipe[0], outPipe[1], -1, m_pid);
+  close(inPipe[0]);
+  close(outPipe[1]);
+  if (spawnErr != 0) {
+    result.error = "posix_spawn() error: " + std::string(strerror(spawnErr));
+    close(inPipe[1]);
+    close(outPipe[0]);
+    m_pid = -1;
+    return false;
+  }
+  m_stdin = inPipe[1];
+  m_stdout = outPipe[0];
+  fcntl(m_stdout, F_SETFL, fcntl(m_stdout, F_GETFL) | O_NONBLOCK);
+  m_buffer.clear();
+  return true;
+}
+
+void CoProcess::stop(ProcessResult *result, bool force) {
+  if (m_pid == -1)
+    return;
+  // EOF on its stdin is the signal to finish up and exit
+  close(m_stdin);
+  m_stdin = -1;
+  if (force) {
+    kill(m_pid, SIGKILL);
+  } else {
+    // give it the grace period to exit by itself, watching for the EOF on
+    // stdout that comes with that
+    using Clock = std::chrono::steady_clock;
+    Clock::time_point deadline = Clock::now() + KillGracePeriod;
+    char buffer[4096];
+    struct pollfd pollFd{m_stdout, POLLIN, 0};
+    while (true) {
+      auto remaining = std::chrono::duration_cast<std::chrono::milliseconds>(
+          deadline - Clock::now());
+      if (remaining <= std::chrono::milliseconds::zero()) {
+        kill(m_pid, SIGKILL);
+        break;
+      }
+      if (poll(&pollFd, 1, remaining.count()) == -1 && errno != EINTR) {
+        kill(m_pid, SIGKILL);
+        break;
+      }
+      ssize_t num = read(m_stdout, buffer, sizeof(buffer));
+      if (num == 0 || (num == -1 && errno != EAGAIN && errno != EINTR))
+        break;
+    }
+  }
+  close(m_stdout);
+  m_stdout = -1;
+
+  ProcessResult exitResult;
+  waitChild(m_pid, exitResult);
+  m_pid = -1;
+  if (result) {
+    result->exitCode = exitResult.exitCode;
+    result->signal = exitResult.signal;
+  }
+}
+
+ProcessResult CoProcess::process(const fs::path &file,
+                                 std::chrono::milliseconds timeout) {
+  // NUL terminated, the one byte a path can't contain
+  std::string request = file.native();
+  request += '\0';
+  for (int tries = 0;; ++tries) {
+    ProcessResult result;
+    bool wasRunning = m_pid != -1;
+    if (!wasRunning && !start(result))
+      return result;
+    // one that was already running may have exited since its last answer
+    // (or crashed on the last file), so it gets one go on a fresh one. One
+    // that dies on the file straight after starting is the file's fault
+    if (exchange(request, timeout, result) || !wasRunning || tries > 0)
+      return result;
+  }
+}
+
+bool CoProcess::exchange(std::string_view request,
+                         std::chrono::milliseconds timeout,
+                         ProcessResult &result) {
+  using Clock = std::chrono::steady_clock;
+  result.spawned = true;
+
+  while (!request.empty()) {
+    ssize_t num = write(m_stdin, request.data(), request.size());
+    if (num == -1) {
+      if (errno == EINTR)
+        continue;
+      int writeErr = errno;
+      result.error = "write() error: " + std::string(strerror(writeErr));
+      stop(&result, true);
+      return writeErr != EPIPE;
+    }
+    request.remove_prefix(num);
+  }
+
+  bool hasDeadline = timeout > std::chrono::milliseconds::zero();
+  Clock::time_point deadline = Clock::now() + timeout;
+  char buffer[4096];
+  size_t end;
+  while ((end = m_buffer.find('\0')) == std::string::npos) {
+    int waitMs = -1;
+    if (hasDeadline) {
+      auto remaining = std::chrono::duration_cast<std::chrono::milliseconds>(
+          deadline - Clock::now());
+      if (remaining <= std::chrono::milliseconds::zero()) {
+        // stuck on this file, a fresh one takes the next
+        result.timedOut = true;
+        stop(&result, true);
+        return true;
+      }
+      waitMs = remaining.count();
+    }
+    struct pollfd pollFd{m_stdout, POLLIN, 0};
+    if (poll(&pollFd, 1, waitMs) == -1) {
+      if (errno == EINTR)
+        continue;
+      result.error = "poll() error: " + std::string(strerror(errno));
+      stop(&result, true);
+      return true;
+    }
+    ssize_t num;
+    while ((num = read(m_stdout, buffer, sizeof(buffer))) > 0) {
+      m_buffer.append(buffer, num);
+    }
+    if (num == 0 && m_buffer.find('\0') == std::string::npos) {
+      // exited without answering, the next file gets a new one
+      stop(&result, false);
+      result.error = "exited before answering";
+      if (result.signal)
+        result.error += ", killed by signal " + std::to_string(result.signal);
+      else
+        result.error += " with code " + std::to_string(result.exitCode);
+      // not a success whatever it exited with
+      result.exitCode = result.exitCode == 0 ? -1 : result.exitCode;
+      return false;
+    }
+    if (num == -1 && errno != EAGAIN && errno != EINTR) {
+      result.error = "read() error: " + std::string(strerror(errno));
+      stop(&result, true);
+      return true;
+    }
+  }
+
+  std::string_view answer(m_buffer.data(), end);
+  if (answer == "ok") {
+    result.exitCode = 0;
+  } else {
+    result.exitCode = 1;
+    result.error = answer.empty() ? "reported failure" : std::string(answer);
+  }
+  m_buffer.erase(0, end + 1);
+  return true;
+}
+
+} // namespace AN
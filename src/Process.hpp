@@ -0,0 +1,78 @@
+#pragma once
+#include <chrono>
+#include <cstddef>
+#include <filesystem>
+#include <span>
+#include <string>
+#include <string_view>
+#include <sys/types.h>
+
+namespace AN {
+namespace fs = std::filesystem;
+
+struct ProcessResult {
+  bool spawned{false};  // false if posix_spawn itself failed, see error
+  bool timedOut{false}; // killed for running past its timeout
+  int exitCode{-1};     // when exited normally
+  int signal{0};        // when killed by a signal
+  std::string out;      // captured stdout/stderr, truncated past the limit
+  std::string err;
+  std::string error; // our own description of what went wrong, if anything
+
+  bool succeeded() const {
+    return spawned && !timedOut && signal == 0 && exitCode == 0;
+  }
+  // one line summary for logs
+  std::string describe() const;
+};
+
+// run command with args (not including argv[0]) via posix_spawn, which on
+// linux/macOS uses vfork style spawning so the daemon's memory isn't copied.
+// stdin is /dev/null, stdout/stderr come back through pipes read in a poll()
+// loop. Returns once the child exits, even if something it started in the
+// background still holds the pipes. A timeout of 0 waits forever, otherwise
+// the child gets SIGTERM then SIGKILL once it's over, pipes closed or not
+ProcessResult runProcess(const fs::path &command,
+                         std::span<const std::string> args,
+                         std::chrono::milliseconds timeout =
+                             std::chrono::milliseconds::zero(),
+                         size_t maxOutput = 1 << 20);
+
+// long running cmd handed one file at a time, for cmds with a slow startup.
+// Each path goes to its stdin NUL terminated, and it answers each in order
+// with a NUL terminated result on stdout: "ok", or anything else as the
+// error. stderr is passed through to ours. If it exits or hangs it's
+// replaced by a fresh one for the next file. Writes to a dead one must come
+// back as EPIPE, so SIGPIPE needs ignoring (see main)
+class CoProcess {
+public:
+  explicit CoProcess(fs::path command);
+  // closes its stdin so it can finish up, killed if it takes too long
+  ~CoProcess();
+  CoProcess(const CoProcess &) = delete;
+  CoProcess &operator=(const CoProcess &) = delete;
+
+  // hand over file and wait up to timeout (0 forever) for its result, starting
+  // the cmd first if it isn't running. out/err are left empty
+  ProcessResult process(const fs::path &file,
+                        std::chrono::milliseconds timeout =
+                            std::chrono::milliseconds::zero());
+
+private:
+  fs::path m_command;
+  pid_t m_pid{-1};
+  int m_stdin{-1};
+  int m_stdout{-1};
+  std::string m_buffer; // stdout read past the last result
+
+  bool start(ProcessResult &result);
+  // write request and read its answer into result. False if it had already
+  // died, or died before answering
+  bool exchange(std::string_view request, std::chrono::milliseconds timeout,
+                ProcessResult &result);
+  // close its stdin and reap it, killing it first if force or it doesn't exit
+  // within the grace period. Its exit status goes in result if given
+  void stop(ProcessResult *result, bool force);
+};
+
+} // namespace AN
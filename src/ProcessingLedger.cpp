@@ -0,0 +1,247 @@
+#include "ProcessingLedger.hpp"
+#include "BackupManager.hpp"
+
+#include <algorithm>
+#include <array>
+#include <iostream>
+#include <random>
+
+namespace AN {
+
+constexpr std::array<std::string_view, ProcessStateCount> ProcessStateNames{
+    "discovered", "stable", "queued", "running", "done", "failed", "dead"};
+
+std::string_view processStateName(ProcessState state) {
+  return state < ProcessStateNames.size() ? ProcessStateNames[state]
+                                          : "unknown";
+}
+
+std::optional<ProcessState> processStateFromName(std::string_view name) {
+  for (size_t i = 0; i < ProcessStateNames.size(); ++i) {
+    if (ProcessStateNames[i] == name)
+      return static_cast<ProcessState>(i);
+  }
+  return std::nullopt;
+}
+
+// wait before the retry following attempt number attempts, see RetryPolicy
+static std::chrono::milliseconds retryDelay(const RetryPolicy &policy,
+                                            uint32_t attempts) {
+  using std::chrono::milliseconds;
+  milliseconds delay = policy.baseDelay;
+  for (uint32_t i = 1; i < attempts && delay < policy.maxDelay; ++i) {
+    delay *= 2;
+  }
+  delay = std::clamp(delay, milliseconds::zero(), policy.maxDelay);
+
+  thread_local std::mt19937 random{std::random_device{}()};
+  std::uniform_int_distribution<int64_t> jitter(0, delay.count() / 2);
+  return delay - milliseconds(jitter(random));
+}
+
+ProcessingLedger::ProcessingLedger(BackupManager *backupManager,
+                                   RetryPolicy retryPolicy,
+                                   std::function<void()> onRetryScheduled,
+                                   ChangeHandler onChange)
+    : m_backupManager(backupManager), m_retryPolicy(retryPolicy),
+      m_onRetryScheduled(std::move(onRetryScheduled)),
+      m_onChange(std::move(onChange)) {}
+
+void ProcessingLedger::restore() {
+  if (!m_backupManager)
+    return;
+  std::lock_guard<std::mutex> lock(m_mutex);
+  m_backupManager->forEachLedgerEntry(
+      [this](std::string_view path, const LedgerEntry &entry) {
+        // done ones shouldn't have been saved, but nothing to do for them
+        if (entry.state != ProcessDone)
+          m_entries.insert_or_assign(std::string(path), entry);
+      });
+
+  // retry times weren't saved, start the failed ones' backoff over
+  auto now = Clock::now();
+  for (auto &[file, entry] : m_entries) {
+    if (entry.state == ProcessFailed && !fail(file, entry, now))
+      save(file, &entry); // out of attempts under a lower max_attempts
+  }
+}
+
+void ProcessingLedger::save(const fs::path &file, const LedgerEntry *entry,
+                            bool forgotten) {
+  if (m_backupManager)
+    m_backupManager->ledgerUpdated(file, entry);
+  if (m_onChange)
+    m_onChange(file, entry, forgotten);
+}
+
+void ProcessingLedger::discovered(std::span<const fs::path> files) {
+  std::lock_guard<std::mutex> lock(m_mutex);
+  for (const fs::path &file : files) {
+    LedgerEntry &entry = m_entries[file.native()];
+    entry = LedgerEntry{};
+    save(file, &entry);
+  }
+}
+
+void ProcessingLedger::advance(std::span<const fs::path> files,
+                               ProcessState state) {
+  std::lock_guard<std::mutex> lock(m_mutex);
+  for (const fs::path &file : files) {
+    LedgerEntry &entry = m_entries[file.native()];
+    entry.state = state;
+    save(file, &entry);
+  }
+}
+
+void ProcessingLedger::started(std::span<const fs::path> files) {
+  {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    for (const fs::path &file : files) {
+      LedgerEntry &entry = m_entries[file.native()];
+      entry.state = ProcessRunning;
+      ++entry.attempts;
+      save(file, &entry);
+    }
+  }
+  // so the attempt still counts if the cmd takes us down with it
+  if (m_backupManager)
+    m_backupManager->flush();
+}
+
+bool ProcessingLedger::fail(const fs::path &file, LedgerEntry &entry,
+                            Clock::time_point now) {
+  if (entry.attempts >= m_retryPolicy.maxAttempts) {
+    if (entry.state != ProcessDeadLetter) {
+      std::cerr << "Giving up on " << file << " after " << entry.attempts
+                << " attempts, last error: " << entry.lastError << "\n";
+    }
+    entry.state = ProcessDeadLetter;
+    return false;
+  }
+  entry.state = ProcessFailed;
+  m_retries.emplace(now + retryDelay(m_retryPolicy, entry.attempts), file);
+  return true;
+}
+
+void ProcessingLedger::finished(std::span<const fs::path> files,
+                                bool succeeded, std::string_view error) {
+  bool retryScheduled = false;
+  {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    auto now = Clock::now();
+    for (const fs::path &file : files) {
+      auto it = m_entries.find(file.native());
+      // changed again while its cmd ran, this result is for the old contents
+      if (it == m_entries.end() || it->second.state != ProcessRunning)
+        continue;
+      if (succeeded) {
+        m_entries.erase(it);
+        save(file, nullptr);
+      } else {
+        it->second.lastError = error;
+        retryScheduled = fail(file, it->second, now) || retryScheduled;
+        save(file, &it->second);
+      }
+    }
+  }
+  // running a cmd again is the expensive part of a crash (and the file may be
+  // gone), so don't leave results waiting for the next scan's flush
+  if (m_backupManager)
+    m_backupManager->flush();
+  if (retryScheduled && m_onRetryScheduled)
+    m_onRetryScheduled();
+}
+
+void ProcessingLedger::forget(const fs::path &file) {
+  std::lock_guard<std::mutex> lock(m_mutex);
+  if (m_entries.erase(file.native()) > 0)
+    save(file, nullptr, true);
+}
+
+void ProcessingLedger::forgetUnder(const fs::path &dir) {
+  std::string prefix = (dir / "").native();
+  std::lock_guard<std::mutex> lock(m_mutex);
+  // everything under it sorts together, starting at the prefix itself
+  auto it = m_entries.lower_bound(prefix);
+  while (it != m_entries.end() && it->first.starts_with(prefix)) {
+    save(it->first, nullptr, true);
+    it = m_entries.erase(it);
+  }
+}
+
+std::vector<fs::path> ProcessingLedger::getUnfinished() const {
+  std::lock_guard<std::mutex> lock(m_mutex);
+  std::vector<fs::path> files;
+  for (const auto &[file, entry] : m_entries) {
+    if (entry.state != ProcessFailed && entry.state != ProcessDeadLetter)
+      files.push_back(file);
+  }
+  return files;
+}
+
+std::vector<fs::path>
+ProcessingLedger::takeDueRetries(Clock::time_point now) {
+  std::lock_guard<std::mutex> lock(m_mutex);
+  std::vector<fs::path> files;
+  while (!m_retries.empty() && m_retries.top().first <= now) {
+    fs::path file = m_retries.top().second;
+    m_retries.pop();
+    // found again or forgotten since. If it's failed again since there's a
+    // later retry queued too, and it goes at whichever comes first
+    auto it = m_entries.find(file.native());
+    if (it == m_entries.end() || it->second.state != ProcessFailed)
+      continue;
+    it->second.state = ProcessStable;
+    save(file, &it->second);
+    files.push_back(std::move(file));
+  }
+  return files;
+}
+
+std::optional<ProcessingLedger::Clock::time_point>
+ProcessingLedger::nextRetry() const {
+  std::lock_guard<std::mutex> lock(m_mutex);
+  if (m_retries.empty())
+    return std::nullopt;
+  return m_retries.top().first;
+}
+
+std::vector<std::pair<fs::path, LedgerEntry>>
+ProcessingLedger::getDeadLetters() const {
+  std::lock_guard<std::mutex> lock(m_mutex);
+  std::vector<std::pair<fs::path, LedgerEntry>> deadLetters;
+  for (const auto &[file, entry] : m_entries) {
+    if (entry.state == ProcessDeadLetter)
+      deadLetters.emplace_back(file, entry);
+  }
+  return deadLetters; // already in path order
+}
+
+void ProcessingLedger::forEachEntry(
+    const std::function<void(std::string_view, const LedgerEntry &)> &visit)
+    const {
+  std::lock_guard<std::mutex> lock(m_mutex);
+  for (const auto &[file, entry] : m_entries) {
+    visit(file, entry);
+  }
+}
+
+std::string ProcessingLedger::forEachEntryAfter(
+    std::string_view cursor, size_t maxVisits,
+    const std::function<bool(std::string_view, const LedgerEntry &)> &visit)
+    const {
+  std::lock_guard<std::mutex> lock(m_mutex);
+  auto it = cursor.empty() ? m_entries.begin() : m_entries.upper_bound(cursor);
+  for (size_t visits = 0; it != m_entries.end(); ++it) {
+    if (!visit(it->first, it->second) || ++visits == maxVisits)
+      return std::next(it) == m_entries.end() ? std::string() : it->first;
+  }
+  return {};
+}
+
+size_t ProcessingLedger::size() const {
+  std::lock_guard<std::mutex> lock(m_mutex);
+  return m_entries.size();
+}
+
+} // namespace AN
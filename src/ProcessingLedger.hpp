@@ -0,0 +1,142 @@
+#pragma once
+#include <chrono>
+#include <cstdint>
+#include <filesystem>
+#include <functional>
+#include <map>
+#include <mutex>
+#include <optional>
+#include <queue>
+#include <span>
+#include <string>
+#include <string_view>
+#include <vector>
+
+namespace AN {
+namespace fs = std::filesystem;
+
+class BackupManager;
+
+// where a file is in being handled by its cmd, in order
+enum ProcessState : uint8_t {
+  ProcessDiscovered, // scanned as new/updated, waiting to settle
+  ProcessStable,     // settled, about to be handed to the executor
+  ProcessQueued,     // in the executor's queue
+  ProcessRunning,    // its cmd is running
+  ProcessDone,       // cmd succeeded, nothing more to do
+  ProcessFailed,     // cmd failed, see LedgerEntry::lastError. Retried later
+  ProcessDeadLetter, // failed RetryPolicy::maxAttempts times, given up on
+};
+// for checking stored values
+constexpr uint8_t ProcessStateCount = ProcessDeadLetter + 1;
+
+struct LedgerEntry {
+  ProcessState state{ProcessDiscovered};
+  uint32_t attempts{0};  // times its cmd was started
+  std::string lastError; // from the most recent failed attempt
+};
+
+// failed cmds are run again after baseDelay, doubling each further failure up
+// to maxDelay, with up to half of it taken off at random so files that failed
+// together (eg a share dropped out) don't all come back at once
+struct RetryPolicy {
+  uint32_t maxAttempts{5}; // 1 never retries
+  std::chrono::milliseconds baseDelay{std::chrono::seconds(30)};
+  std::chrono::milliseconds maxDelay{std::chrono::hours(1)};
+};
+
+// "discovered", "stable" etc for the text backends and logs
+std::string_view processStateName(ProcessState state);
+// nullopt if name isn't one of processStateName's
+std::optional<ProcessState> processStateFromName(std::string_view name);
+
+// per file lifecycle of everything found needing its cmd run, so a restart
+// picks up exactly the work that hadn't finished. Done files are dropped
+// rather than kept around, a tracked file with no entry has nothing to do.
+// Every change is passed straight on to the BackupManager. Thread safe, the
+// executor threads report in while the run thread adds more.
+// Failed files wait for their retry time, which isn't saved, after a restart
+// they wait out their backoff again from then
+class ProcessingLedger {
+public:
+  using Clock = std::chrono::steady_clock;
+  // file and its new entry, nullptr once it's left the ledger. forgotten says
+  // why: dropped by forget()/forgetUnder() without being done, rather than
+  // its cmd succeeding
+  using ChangeHandler = std::function<void(
+      const fs::path &, const LedgerEntry *, bool forgotten)>;
+
+  // onRetryScheduled (optional) is called from whichever thread reports a
+  // failure, so whoever waits on nextRetry() can wait less. onChange
+  // (optional) sees every change as it's saved, with the ledger locked so
+  // keep it quick and don't call back in
+  explicit ProcessingLedger(BackupManager *backupManager,
+                            RetryPolicy retryPolicy = {},
+                            std::function<void()> onRetryScheduled = {},
+                            ChangeHandler onChange = {});
+
+  // load whatever the backup had, call once before anything else
+  void restore();
+
+  // found new/updated again, any earlier attempt no longer counts
+  void discovered(std::span<const fs::path> files);
+  // Stable or Queued
+  void advance(std::span<const fs::path> files, ProcessState state);
+  // Running, counts an attempt. Flushes the backup like finished()
+  void started(std::span<const fs::path> files);
+  // Done (dropped), or Failed with error and a retry scheduled (dead letter
+  // once out of attempts), then flushes the backup. Files that were
+  // discovered again while running are left for their next go
+  void finished(std::span<const fs::path> files, bool succeeded,
+                std::string_view error = {});
+  // drop without running, eg the file went away
+  void forget(const fs::path &file);
+  // forget everything under dir, eg its root is no longer watched
+  void forgetUnder(const fs::path &dir);
+
+  // everything not yet done or failed, the work lost if we stopped now
+  std::vector<fs::path> getUnfinished() const;
+  // failed files whose retry is due, now Stable again
+  std::vector<fs::path> takeDueRetries(Clock::time_point now);
+  // when the next retry is due, nullopt if none are waiting
+  std::optional<Clock::time_point> nextRetry() const;
+  // files given up on, for the control socket
+  std::vector<std::pair<fs::path, LedgerEntry>> getDeadLetters() const;
+  // visit(path, entry) for every entry, for the backends written in full
+  void forEachEntry(
+      const std::function<void(std::string_view, const LedgerEntry &)> &visit)
+      const;
+  // visit(path, entry) in path order for entries after cursor (from the
+  // start if empty) until it returns false, or maxVisits have been seen.
+  // Returns the last path visited, to carry on from next time, empty if it
+  // got to the end. Holds the ledger for the duration, keep pages small
+  std::string forEachEntryAfter(
+      std::string_view cursor, size_t maxVisits,
+      const std::function<bool(std::string_view, const LedgerEntry &)> &visit)
+      const;
+  size_t size() const;
+
+private:
+  using Retry = std::pair<Clock::time_point, fs::path>;
+
+  BackupManager *m_backupManager;
+  RetryPolicy m_retryPolicy;
+  std::function<void()> m_onRetryScheduled;
+  ChangeHandler m_onChange;
+  mutable std::mutex m_mutex; // everything below
+  // ordered so the control socket can page through it by path
+  std::map<std::string, LedgerEntry, std::less<>> m_entries;
+  // earliest first. Entries that moved on since are skipped when they come
+  // up, rather than searched for and removed
+  std::priority_queue<Retry, std::vector<Retry>, std::greater<Retry>>
+      m_retries;
+
+  // m_mutex must be held for these
+  void save(const fs::path &file, const LedgerEntry *entry,
+            bool forgotten = false);
+  // Failed, or ProcessDeadLetter if out of attempts. True if a retry was
+  // scheduled
+  bool fail(const fs::path &file, LedgerEntry &entry, Clock::time_point now);
+};
+
+} // namespace AN
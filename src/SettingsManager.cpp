@@ -1,8 +1,11 @@
 #include "SettingsManager.hpp"
 #include "FoldersManager.hpp"
+#include <algorithm>
+#include <chrono>
 #include <filesystem>
 #include <fstream>
 #include <stdexcept>
+#include <thread>
 
 namespace AN {
 namespace fs = std::filesystem;
@@ -23,12 +26,85 @@ std::vector<FileSettings> SettingsManager::getFileSettings() {
     settings.extension = filetypesetting["extension"].template get<std::string>();
     settings.cmd = filetypesetting["cmd"].template get<std::string>();
     settings.keep = filetypesetting["keep"].template get<bool>();
+    settings.parallel = filetypesetting.value("parallel", settings.parallel);
+    settings.stream = filetypesetting.value("stream", settings.stream);
+    settings.maxConcurrency = std::max(
+        filetypesetting.value("max_concurrency", settings.maxConcurrency), 1u);
+    settings.timeoutSeconds =
+        filetypesetting.value("timeout_seconds", settings.timeoutSeconds);
+    settings.maxFilesPerCmd =
+        filetypesetting.value("max_files_per_cmd", settings.maxFilesPerCmd);
+    settings.maxArgBytes =
+        filetypesetting.value("max_arg_bytes", settings.maxArgBytes);
 
     allFileSettings.push_back(settings);
   }
   return allFileSettings;
 }
 
+unsigned SettingsManager::getScanThreads() {
+  if (m_json.contains("scan_threads")) {
+    return std::max(m_json["scan_threads"].template get<unsigned>(), 1u);
+  }
+  // hardware_concurrency may not know, 0 then
+  return std::max(std::thread::hardware_concurrency(), 1u);
+}
+
+unsigned SettingsManager::getExecutorThreads() {
+  if (m_json.contains("executor_threads")) {
+    return std::max(m_json["executor_threads"].template get<unsigned>(), 1u);
+  }
+  return std::max(std::thread::hardware_concurrency(), 1u);
+}
+
+size_t SettingsManager::getExecutorQueueSize() {
+  return std::max<size_t>(m_json.value("executor_queue_size", 256), 1);
+}
+
+std::string SettingsManager::getBackupBackend() {
+  return m_json.value("backup_backend", std::string("json"));
+}
+
+ChangeDetection SettingsManager::getChangeDetection() {
+  std::string mode = m_json.value("change_detection", std::string("metadata"));
+  if (mode == "metadata")
+    return ChangeMetadata;
+  if (mode == "content")
+    return ChangeContent;
+  throw std::invalid_argument("Unknown change_detection: " + mode);
+}
+
+StartupScan SettingsManager::getStartupScan() {
+  std::string mode = m_json.value("startup_scan", std::string("changed"));
+  if (mode == "changed")
+    return StartupScanChanged;
+  if (mode == "full")
+    return StartupScanFull;
+  throw std::invalid_argument("Unknown startup_scan: " + mode);
+}
+
+double SettingsManager::getEventLatency() {
+  return std::max(m_json.value("event_latency_seconds", 3.0), 0.0);
+}
+
+double SettingsManager::getSettleSeconds() {
+  return std::max(m_json.value("settle_seconds", 2.0), 0.0);
+}
+
+RetryPolicy SettingsManager::getRetryPolicy() {
+  auto toMs = [](double seconds) {
+    return std::chrono::milliseconds(
+        static_cast<int64_t>(std::max(seconds, 0.0) * 1000));
+  };
+  RetryPolicy policy;
+  policy.maxAttempts =
+      std::max(m_json.value("max_attempts", policy.maxAttempts), 1u);
+  policy.baseDelay = toMs(m_json.value("retry_base_seconds", 30.0));
+  policy.maxDelay = std::max(toMs(m_json.value("retry_max_seconds", 3600.0)),
+                             policy.baseDelay);
+  return policy;
+}
+
 }; // namespace AN
 
 // // struct FileSettings {
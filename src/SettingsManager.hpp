@@ -15,11 +15,38 @@ using Json = nlohmann::json; // json is type, so capitalize...
 
 // schema:
 // {
+//   "scan_threads": num, (optional, defaults to number of cores)
+//   "executor_threads": num, (optional, defaults to number of cores)
+//   "executor_queue_size": num, (optional, jobs waiting before scans block)
+//   "backup_backend": "json" | "journal" | "snapshot" | "sqlite", (optional,
+//                     json)
+//   "change_detection": "metadata" | "content", (optional, metadata) see
+//                       ChangeDetection
+//   "startup_scan": "changed" | "full", (optional, changed) how roots restored
+//                   from the backup catch up, see StartupScan. full also
+//                   finds files rewritten in place while not running
+//   "event_latency_seconds": num, (optional, 3, FSEvents coalescing only)
+//   "settle_seconds": num, (optional, 2, how long a new file must stay
+//                     unchanged before it's processed. 0 processes at once)
+//   "max_attempts": num, (optional, 5, cmd runs before a file is given up on)
+//   "retry_base_seconds": num, (optional, 30, wait before the first retry,
+//                         doubling after each failure)
+//   "retry_max_seconds": num, (optional, 3600, longest wait between retries)
 //   "filetype_settings": [
 //     {
 //       "extension": ".txt",
 //       "cmd": "path",
 //       "keep": bool,
+//       "parallel": bool, (optional, cmd per file instead of per batch)
+//       "stream": bool, (optional, keep cmd running and pass it files on
+//                 stdin instead, see CoProcess for what it has to speak.
+//                 max_concurrency of them run at most)
+//       "max_concurrency": num, (optional, cmds of this type at once)
+//       "timeout_seconds": num, (optional, kill cmd after this long)
+//       "max_files_per_cmd": num, (optional, split batches bigger than this,
+//                            chunks run side by side up to max_concurrency)
+//       "max_arg_bytes": num, (optional, likewise for the filenames' total
+//                        length. Batches are always kept under ARG_MAX)
 //     }
 //   ]
 // }
@@ -29,6 +56,20 @@ public:
   SettingsManager(fs::path settingsFile);
 
   std::vector<FileSettings> getFileSettings();
+  // threads for each folder's full scans. More than cores can help on network
+  // shares where most of the time is waiting on the server
+  unsigned getScanThreads();
+  // threads running cmds, across all file types
+  unsigned getExecutorThreads();
+  size_t getExecutorQueueSize();
+  // which BackupManager to keep state with, see makeBackupManager
+  std::string getBackupBackend();
+  ChangeDetection getChangeDetection();
+  StartupScan getStartupScan();
+  double getEventLatency();
+  double getSettleSeconds();
+  // for failed cmds, see ProcessingLedger
+  RetryPolicy getRetryPolicy();
   // std::vector<fs::path> getFolders();
 
 private:
@@ -0,0 +1,95 @@
+#include "SettleQueue.hpp"
+
+#include <algorithm>
+
+namespace AN {
+
+SettleQueue::SettleQueue(std::chrono::milliseconds quietWindow)
+    : m_quietWindow(std::max(quietWindow, std::chrono::milliseconds::zero())) {
+}
+
+void SettleQueue::add(const fs::path &path, const FileFingerprint &fingerprint,
+                      Clock::time_point now) {
+  auto [it, inserted] =
+      m_pending.try_emplace(path, Pending{fingerprint, now, false, 0});
+  Pending &pending = it->second;
+  if (inserted) {
+    pending.order = m_nextOrder++;
+  } else if (!pending.fingerprint.sameMetadata(fingerprint)) {
+    // still being written, any earlier close was for an earlier write
+    pending.fingerprint = fingerprint;
+    pending.lastChange = now;
+    pending.isClosed = false;
+  }
+}
+
+void SettleQueue::closed(const fs::path &path) {
+  auto it = m_pending.find(path);
+  if (it != m_pending.end())
+    it->second.isClosed = true;
+}
+
+void SettleQueue::dropUnder(const fs::path &dir) {
+  std::string prefix = (dir / "").native();
+  std::erase_if(m_pending, [&prefix](const auto &pathAndPending) {
+    return pathAndPending.first.native().starts_with(prefix);
+  });
+}
+
+std::vector<fs::path>
+SettleQueue::takeSettled(Clock::time_point now,
+                         std::vector<fs::path> *vanished) {
+  std::vector<std::pair<uint64_t, fs::path>> settled;
+  for (auto it = m_pending.begin(); it != m_pending.end();) {
+    Pending &pending = it->second;
+    if (m_quietWindow.count() == 0) {
+      settled.emplace_back(pending.order, it->first);
+      it = m_pending.erase(it);
+      continue;
+    }
+    if (!pending.isClosed && now - pending.lastChange < m_quietWindow) {
+      ++it;
+      continue;
+    }
+
+    FileFingerprint current = getFingerprint(it->first);
+    if (!current.isKnown()) {
+      // deleted or moved away mid copy, wherever it went gets its own event
+      if (vanished)
+        vanished->push_back(it->first);
+      it = m_pending.erase(it);
+    } else if (current.sameMetadata(pending.fingerprint)) {
+      settled.emplace_back(pending.order, it->first);
+      it = m_pending.erase(it);
+    } else {
+      // changed without us hearing about it yet, give it another window
+      pending.fingerprint = current;
+      pending.lastChange = now;
+      pending.isClosed = false;
+      ++it;
+    }
+  }
+
+  std::sort(settled.begin(), settled.end(),
+            [](const auto &a, const auto &b) { return a.first < b.first; });
+  std::vector<fs::path> files;
+  files.reserve(settled.size());
+  for (auto &[order, path] : settled) {
+    files.push_back(std::move(path));
+  }
+  return files;
+}
+
+std::optional<SettleQueue::Clock::time_point>
+SettleQueue::nextDeadline() const {
+  std::optional<Clock::time_point> deadline;
+  for (const auto &[path, pending] : m_pending) {
+    Clock::time_point due = pending.isClosed ? Clock::time_point::min()
+                                             : pending.lastChange + m_quietWindow;
+    if (!deadline || due < *deadline)
+      deadline = due;
+  }
+  return deadline;
+}
+
+} // namespace AN
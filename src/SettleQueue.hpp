@@ -0,0 +1,53 @@
+#pragma once
+#include "Fingerprint.hpp"
+#include <chrono>
+#include <filesystem>
+#include <optional>
+#include <unordered_map>
+#include <vector>
+
+namespace AN {
+namespace fs = std::filesystem;
+
+// holds new/updated files back from the cmds until they stop changing, so a
+// file still being copied in isn't processed half written. A file settles
+// once its fingerprint has stayed the same for the quiet window, or straight
+// away once its writer closes it where the EventSource can tell (inotify,
+// FSEvents only reports folders). Only used from the run thread
+class SettleQueue {
+public:
+  using Clock = std::chrono::steady_clock;
+
+  // quietWindow 0 lets everything through on the next takeSettled()
+  explicit SettleQueue(std::chrono::milliseconds quietWindow);
+
+  // seen new/changed by a scan, restarts its window if it changed since
+  void add(const fs::path &path, const FileFingerprint &fingerprint,
+           Clock::time_point now);
+  // writer closed it, can go as soon as a stat agrees nothing moved since
+  void closed(const fs::path &path);
+  // stop waiting on everything under dir, eg its root is no longer watched
+  void dropUnder(const fs::path &dir);
+  // every file that's settled by now, in the order they were added. Files
+  // whose window is up get restatted first, and start over if they changed.
+  // Ones found gone are dropped, and added to vanished if given
+  std::vector<fs::path> takeSettled(Clock::time_point now,
+                                    std::vector<fs::path> *vanished = nullptr);
+  // earliest a pending file could settle, nothing if none are pending
+  std::optional<Clock::time_point> nextDeadline() const;
+  size_t size() const { return m_pending.size(); }
+
+private:
+  struct Pending {
+    FileFingerprint fingerprint;
+    Clock::time_point lastChange;
+    bool isClosed{false};
+    uint64_t order; // keeps batches in scan order
+  };
+
+  std::chrono::milliseconds m_quietWindow;
+  std::unordered_map<fs::path, Pending> m_pending;
+  uint64_t m_nextOrder{0};
+};
+
+} // namespace AN
@@ -0,0 +1,369 @@
+#include "SnapshotManager.hpp"
+#include "FoldersManager.hpp"
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <fcntl.h>
+#include <iostream>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace AN {
+
+constexpr char SnapshotMagic[8] = {'A', 'N', 'S', 'N', 'A', 'P', '\0', '\0'};
+// bump whenever the layout below changes, older files are then ignored
+constexpr uint32_t SnapshotVersion = 5;
+// reads back differently on a machine of the other endianness
+constexpr uint32_t ByteOrderMark = 0x01020304;
+
+struct SnapshotManager::Header {
+  char magic[8];
+  uint32_t version;
+  uint32_t byteOrder;
+  uint64_t lastEventId;
+  uint64_t rootCount;
+  uint64_t recordCount;
+  uint64_t dirCount;
+  uint64_t ledgerCount;
+  uint64_t stringsSize;
+};
+
+struct SnapshotManager::Root {
+  uint64_t pathOffset;
+  uint64_t pathLength;
+  uint64_t firstRecord;
+  uint64_t recordCount;
+  uint64_t firstDir;
+  uint64_t dirCount;
+};
+
+struct SnapshotManager::Record {
+  uint64_t pathOffset;
+  uint64_t pathLength;
+  int64_t mtimeNs;
+  uint64_t size;
+  uint64_t inode;
+  uint64_t contentHash;
+};
+
+struct SnapshotManager::DirRecord {
+  uint64_t pathOffset;
+  uint64_t pathLength;
+  int64_t mtimeNs;
+  uint64_t inode;
+  uint64_t linkCount;
+};
+
+struct SnapshotManager::LedgerRecord {
+  uint64_t pathOffset;
+  uint64_t pathLength;
+  uint64_t errorOffset;
+  uint64_t errorLength;
+  uint32_t state;
+  uint32_t attempts;
+};
+
+SnapshotManager::SnapshotManager(fs::path backupFile)
+    : m_snapshotFile(backupFile.string() + ".snap") {
+  load();
+}
+
+SnapshotManager::~SnapshotManager() { unload(); }
+
+bool SnapshotManager::load() {
+  int fd = open(m_snapshotFile.c_str(), O_RDONLY | O_CLOEXEC);
+  if (fd == -1) {
+    if (errno != ENOENT) {
+      std::cerr << "Failed to open snapshot " << m_snapshotFile << ": "
+                << strerror(errno) << "\n";
+    }
+    return false;
+  }
+
+  struct stat attributes;
+  if (fstat(fd, &attributes) == -1 ||
+      static_cast<size_t>(attributes.st_size) < sizeof(Header)) {
+    std::cerr << "Ignoring truncated snapshot " << m_snapshotFile << "\n";
+    close(fd);
+    return false;
+  }
+  size_t size = attributes.st_size;
+  void *mapping = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd); // mapping keeps its own reference
+  if (mapping == MAP_FAILED) {
+    std::cerr << "Failed to mmap snapshot " << m_snapshotFile << ": "
+              << strerror(errno) << "\n";
+    return false;
+  }
+  m_mapping = static_cast<const char *>(mapping);
+  m_mappingSize = size;
+
+  // check every table fits before trusting any of it. Records are only
+  // bounds checked as they're read, so a restore never touches other roots
+  const Header *header = reinterpret_cast<const Header *>(m_mapping);
+  size_t remaining = size - sizeof(Header);
+  bool isValid =
+      memcmp(header->magic, SnapshotMagic, sizeof(SnapshotMagic)) == 0 &&
+      header->version == SnapshotVersion &&
+      header->byteOrder == ByteOrderMark &&
+      header->rootCount <= remaining / sizeof(Root);
+  if (isValid) {
+    remaining -= header->rootCount * sizeof(Root);
+    isValid = header->recordCount <= remaining / sizeof(Record);
+  }
+  if (isValid) {
+    remaining -= header->recordCount * sizeof(Record);
+    isValid = header->dirCount <= remaining / sizeof(DirRecord);
+  }
+  if (isValid) {
+    remaining -= header->dirCount * sizeof(DirRecord);
+    isValid = header->ledgerCount <= remaining / sizeof(LedgerRecord);
+  }
+  if (isValid) {
+    remaining -= header->ledgerCount * sizeof(LedgerRecord);
+    isValid = header->stringsSize <= remaining;
+  }
+  if (!isValid) {
+    std::cerr << "Ignoring unreadable snapshot " << m_snapshotFile << "\n";
+    unload();
+    return false;
+  }
+
+  m_header = header;
+  m_roots = reinterpret_cast<const Root *>(m_mapping + sizeof(Header));
+  m_records = reinterpret_cast<const Record *>(m_roots + header->rootCount);
+  m_dirs = reinterpret_cast<const DirRecord *>(m_records + header->recordCount);
+  m_ledger = reinterpret_cast<const LedgerRecord *>(m_dirs + header->dirCount);
+  m_strings = reinterpret_cast<const char *>(m_ledger + header->ledgerCount);
+  for (uint64_t i = 0; i < header->rootCount; ++i) {
+    const Root &root = m_roots[i];
+    if (root.firstRecord > header->recordCount ||
+        root.recordCount > header->recordCount - root.firstRecord ||
+        root.firstDir > header->dirCount ||
+        root.dirCount > header->dirCount - root.firstDir) {
+      std::cerr << "Ignoring unreadable snapshot " << m_snapshotFile << "\n";
+      unload();
+      return false;
+    }
+  }
+  // each root is read front to back
+  madvise(const_cast<char *>(m_mapping), m_mappingSize, MADV_SEQUENTIAL);
+  return true;
+}
+
+void SnapshotManager::unload() {
+  if (m_mapping)
+    munmap(const_cast<char *>(m_mapping), m_mappingSize);
+  m_mapping = nullptr;
+  m_mappingSize = 0;
+  m_header = nullptr;
+  m_roots = nullptr;
+  m_records = nullptr;
+  m_dirs = nullptr;
+  m_ledger = nullptr;
+  m_strings = nullptr;
+}
+
+std::string_view SnapshotManager::getString(uint64_t offset,
+                                            uint64_t length) const {
+  if (offset > m_header->stringsSize ||
+      length > m_header->stringsSize - offset)
+    return {};
+  return {m_strings + offset, length};
+}
+
+const SnapshotManager::Root *
+SnapshotManager::findRoot(std::string_view root) const {
+  if (!m_header)
+    return nullptr;
+  const Root *end = m_roots + m_header->rootCount;
+  const Root *found = std::lower_bound(
+      m_roots, end, root, [this](const Root &entry, std::string_view target) {
+        return getString(entry.pathOffset, entry.pathLength) < target;
+      });
+  if (found == end || getString(found->pathOffset, found->pathLength) != root)
+    return nullptr;
+  return found;
+}
+
+EventId SnapshotManager::getLastObservedEventId() {
+  return m_header ? m_header->lastEventId : EventIdSinceNow;
+}
+
+bool SnapshotManager::isMonitoredRoot(fs::path path) {
+  return findRoot(path.native()) != nullptr;
+}
+
+void SnapshotManager::forEachRootFile(
+    const fs::path &root,
+    const std::function<void(std::string_view, const FileFingerprint &)>
+        &visit) {
+  const Root *found = findRoot(root.native());
+  if (!found)
+    return;
+  const Record *end = m_records + found->firstRecord + found->recordCount;
+  for (const Record *record = m_records + found->firstRecord; record != end;
+       ++record) {
+    std::string_view path = getString(record->pathOffset, record->pathLength);
+    if (!path.empty()) {
+      visit(path, FileFingerprint{record->mtimeNs, record->size, record->inode,
+                                  record->contentHash});
+    }
+  }
+}
+
+void SnapshotManager::forEachRootDir(
+    const fs::path &root,
+    const std::function<void(std::string_view, const DirStamp &)> &visit) {
+  const Root *found = findRoot(root.native());
+  if (!found)
+    return;
+  const DirRecord *end = m_dirs + found->firstDir + found->dirCount;
+  for (const DirRecord *dir = m_dirs + found->firstDir; dir != end; ++dir) {
+    std::string_view path = getString(dir->pathOffset, dir->pathLength);
+    if (!path.empty())
+      visit(path, DirStamp{dir->mtimeNs, dir->inode, dir->linkCount});
+  }
+}
+
+std::vector<std::pair<fs::path, FileFingerprint>>
+SnapshotManager::getRootMonitoredFiles(fs::path path) {
+  std::vector<std::pair<fs::path, FileFingerprint>> pathsAndTimes;
+  forEachRootFile(path, [&](std::string_view file,
+                            const FileFingerprint &fingerprint) {
+    pathsAndTimes.emplace_back(file, fingerprint);
+  });
+  return pathsAndTimes;
+}
+
+void SnapshotManager::forEachLedgerEntry(
+    const std::function<void(std::string_view, const LedgerEntry &)> &visit) {
+  if (!m_header)
+    return;
+  for (uint64_t i = 0; i < m_header->ledgerCount; ++i) {
+    const LedgerRecord &record = m_ledger[i];
+    std::string_view path = getString(record.pathOffset, record.pathLength);
+    if (path.empty())
+      continue;
+    LedgerEntry entry;
+    // from a newer build maybe, take another look at the file
+    entry.state = record.state < ProcessStateCount
+                      ? static_cast<ProcessState>(record.state)
+                      : ProcessDiscovered;
+    entry.attempts = record.attempts;
+    entry.lastError = getString(record.errorOffset, record.errorLength);
+    visit(path, entry);
+  }
+}
+
+void SnapshotManager::getFolderManagerUpdate(FoldersManager &manager) {
+  m_outEventId = manager.getLatestEventId();
+  m_outLedger.clear();
+  manager.getLedger().forEachEntry(
+      [this](std::string_view path, const LedgerEntry &entry) {
+        m_outLedger.emplace_back(std::string(path), entry);
+      });
+}
+
+void SnapshotManager::getFolderScannerUpdate(FolderScanner &scanner) {
+  std::vector<std::pair<std::string, FileFingerprint>> files;
+  scanner.forEachFile(
+      [&files](const fs::path &path, const FileFingerprint &fingerprint) {
+        files.emplace_back(path.string(), fingerprint);
+      });
+  std::sort(files.begin(), files.end(),
+            [](const auto &a, const auto &b) { return a.first < b.first; });
+  std::vector<std::pair<std::string, DirStamp>> dirs;
+  scanner.forEachDir([&dirs](const fs::path &dir, const DirStamp &stamp) {
+    dirs.emplace_back(dir.string(), stamp);
+  });
+  m_outRoots.push_back(
+      {scanner.getRoot().string(), std::move(files), std::move(dirs)});
+}
+
+void SnapshotManager::updateBackup() {
+  // roots sorted for findRoot's binary search
+  std::sort(m_outRoots.begin(), m_outRoots.end(),
+            [](const OutRoot &a, const OutRoot &b) { return a.path < b.path; });
+
+  Header header{};
+  memcpy(header.magic, SnapshotMagic, sizeof(SnapshotMagic));
+  header.version = SnapshotVersion;
+  header.byteOrder = ByteOrderMark;
+  header.lastEventId = m_outEventId;
+  header.rootCount = m_outRoots.size();
+
+  std::vector<Root> roots;
+  std::vector<Record> records;
+  std::vector<DirRecord> dirs;
+  std::string strings;
+  for (const OutRoot &root : m_outRoots) {
+    roots.push_back({strings.size(), root.path.size(), records.size(),
+                     root.files.size(), dirs.size(), root.dirs.size()});
+    strings += root.path;
+    for (const auto &[path, fingerprint] : root.files) {
+      records.push_back({strings.size(), path.size(), fingerprint.mtimeNs,
+                         fingerprint.size, fingerprint.inode,
+                         fingerprint.contentHash});
+      strings += path;
+    }
+    for (const auto &[path, stamp] : root.dirs) {
+      dirs.push_back({strings.size(), path.size(), stamp.mtimeNs, stamp.inode,
+                      stamp.linkCount});
+      strings += path;
+    }
+  }
+  header.recordCount = records.size();
+  header.dirCount = dirs.size();
+
+  std::vector<LedgerRecord> ledger;
+  ledger.reserve(m_outLedger.size());
+  for (const auto &[path, entry] : m_outLedger) {
+    LedgerRecord record{strings.size(), path.size(), 0, entry.lastError.size(),
+                        entry.state, entry.attempts};
+    strings += path;
+    record.errorOffset = strings.size();
+    strings += entry.lastError;
+    ledger.push_back(record);
+  }
+  header.ledgerCount = ledger.size();
+  header.stringsSize = strings.size();
+
+  fs::path tmpFile = m_snapshotFile.string() + ".tmp";
+  int fd = open(tmpFile.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC,
+                0644);
+  if (fd == -1) {
+    std::cerr << "Failed to open " << tmpFile << ": " << strerror(errno)
+              << "\n";
+    return;
+  }
+  auto bytes = [](const auto &items) {
+    return std::string_view(reinterpret_cast<const char *>(items.data()),
+                            items.size() * sizeof(items[0]));
+  };
+  bool ok =
+      writeAll(fd, std::string_view(reinterpret_cast<const char *>(&header),
+                                    sizeof(header))) &&
+      writeAll(fd, bytes(roots)) && writeAll(fd, bytes(records)) &&
+      writeAll(fd, bytes(dirs)) && writeAll(fd, bytes(ledger)) &&
+      writeAll(fd, strings) && fsync(fd) == 0;
+  close(fd);
+
+  std::error_code ec;
+  if (!ok) {
+    std::cerr << "Failed to write snapshot: " << strerror(errno) << "\n";
+    fs::remove(tmpFile, ec);
+    return;
+  }
+  // the current mapping stays valid, it holds on to the old file
+  fs::rename(tmpFile, m_snapshotFile, ec);
+  if (ec) {
+    std::cerr << "Failed to replace snapshot: " << ec.message() << "\n";
+  }
+  m_outRoots.clear();
+  m_outLedger.clear();
+}
+
+} // namespace AN
@@ -0,0 +1,88 @@
+#pragma once
+#include "BackupManager.hpp"
+#include <cstdint>
+#include <filesystem>
+#include <string>
+#include <utility>
+#include <vector>
+
+namespace AN {
+namespace fs = std::filesystem;
+
+// versioned binary snapshot, mmapped on startup so restoring a root is a
+// binary search over the root table plus a walk of that root's fixed size
+// records, with paths handed out as views into the mapping. Written in full
+// on updateBackup like JsonManager, to <backupFile>.snap. Layout:
+//   header
+//   root table     {path offset, path length, first record, record count,
+//                  first dir, dir count}[] sorted by root path
+//   record table   {path offset, path length, fingerprint}[] sorted within
+//                  each root
+//   dir table      {path offset, path length, DirStamp}[] grouped by root
+//   ledger table   {path offset, path length, error offset, error length,
+//                  state, attempts}[], see ProcessingLedger
+//   string table   every path's (and error's) bytes back to back, no
+//                  terminators
+class SnapshotManager : public BackupManager {
+public:
+  SnapshotManager(fs::path backupFile);
+  ~SnapshotManager();
+
+  EventId getLastObservedEventId() override;
+
+  bool isMonitoredRoot(fs::path path) override;
+
+  std::vector<std::pair<fs::path, FileFingerprint>>
+  getRootMonitoredFiles(fs::path path) override;
+  void forEachRootFile(
+      const fs::path &root,
+      const std::function<void(std::string_view, const FileFingerprint &)>
+          &visit) override;
+  void forEachRootDir(
+      const fs::path &root,
+      const std::function<void(std::string_view, const DirStamp &)> &visit)
+      override;
+
+  void getFolderManagerUpdate(FoldersManager &manager) override;
+  void getFolderScannerUpdate(FolderScanner &scanner) override;
+  void updateBackup() override;
+
+  void forEachLedgerEntry(
+      const std::function<void(std::string_view, const LedgerEntry &)> &visit)
+      override;
+
+private:
+  struct Header;
+  struct Root;
+  struct Record;
+  struct DirRecord;
+  struct LedgerRecord;
+  struct OutRoot {
+    std::string path;
+    std::vector<std::pair<std::string, FileFingerprint>> files;
+    std::vector<std::pair<std::string, DirStamp>> dirs;
+  };
+
+  fs::path m_snapshotFile;
+  // loaded snapshot, nullptr if there was none or it didn't validate
+  const char *m_mapping{nullptr};
+  size_t m_mappingSize{0};
+  const Header *m_header{nullptr};
+  const Root *m_roots{nullptr};
+  const Record *m_records{nullptr};
+  const DirRecord *m_dirs{nullptr};
+  const LedgerRecord *m_ledger{nullptr};
+  const char *m_strings{nullptr};
+
+  // gathered for the next write
+  EventId m_outEventId{EventIdSinceNow};
+  std::vector<OutRoot> m_outRoots;
+  std::vector<std::pair<std::string, LedgerEntry>> m_outLedger;
+
+  bool load();
+  void unload();
+  const Root *findRoot(std::string_view root) const;
+  std::string_view getString(uint64_t offset, uint64_t length) const;
+};
+
+} // namespace AN
@@ -0,0 +1,428 @@
+#include "SqliteManager.hpp"
+#include "FoldersManager.hpp"
+
+#include <algorithm>
+#include <iostream>
+#include <stdexcept>
+
+namespace AN {
+
+// PRAGMA user_version, bump and add a step to migrateSchema when tables change
+constexpr int SchemaVersion = 4;
+
+SqliteManager::SqliteManager(fs::path backupFile, size_t commitBatch)
+    : m_commitBatch(std::max<size_t>(commitBatch, 1)) {
+  fs::path dbFile = backupFile.string() + ".sqlite";
+  // FULLMUTEX isn't needed, m_mutex already serialises every use
+  if (sqlite3_open_v2(dbFile.c_str(), &m_db,
+                      SQLITE_OPEN_READWRITE | SQLITE_OPEN_CREATE |
+                          SQLITE_OPEN_NOMUTEX,
+                      nullptr) != SQLITE_OK) {
+    std::string error = m_db ? sqlite3_errmsg(m_db) : "out of memory";
+    sqlite3_close(m_db);
+    throw std::runtime_error("Failed to open " + dbFile.string() + ": " +
+                             error);
+  }
+
+  // WAL + NORMAL: commits don't fsync every time, a crash can only lose the
+  // last few, never corrupt the database
+  exec("PRAGMA journal_mode=WAL");
+  exec("PRAGMA synchronous=NORMAL");
+  exec("CREATE TABLE IF NOT EXISTS meta ("
+       "key TEXT PRIMARY KEY, value INTEGER NOT NULL)");
+  exec("CREATE TABLE IF NOT EXISTS roots ("
+       "id INTEGER PRIMARY KEY, path TEXT UNIQUE NOT NULL)");
+  exec("CREATE TABLE IF NOT EXISTS files ("
+       "root_id INTEGER NOT NULL, path TEXT NOT NULL, "
+       "mtime_ns INTEGER NOT NULL DEFAULT 0, size INTEGER NOT NULL DEFAULT 0, "
+       "inode INTEGER NOT NULL DEFAULT 0, hash INTEGER NOT NULL DEFAULT 0, "
+       "PRIMARY KEY (root_id, path)) WITHOUT ROWID");
+  exec("CREATE TABLE IF NOT EXISTS dirs ("
+       "root_id INTEGER NOT NULL, path TEXT NOT NULL, "
+       "mtime_ns INTEGER NOT NULL, inode INTEGER NOT NULL, "
+       "links INTEGER NOT NULL DEFAULT 0, "
+       "PRIMARY KEY (root_id, path)) WITHOUT ROWID");
+  exec("CREATE TABLE IF NOT EXISTS ledger ("
+       "path TEXT PRIMARY KEY, state INTEGER NOT NULL, "
+       "attempts INTEGER NOT NULL DEFAULT 0, error TEXT NOT NULL DEFAULT '') "
+       "WITHOUT ROWID");
+  migrateSchema();
+
+  m_selectRoot = prepare("SELECT id FROM roots WHERE path = ?1");
+  m_insertRoot = prepare("INSERT INTO roots (path) VALUES (?1)");
+  m_selectRootFiles = prepare("SELECT path, mtime_ns, size, inode, hash "
+                              "FROM files WHERE root_id = ?1");
+  m_upsertFile = prepare(
+      "INSERT INTO files (root_id, path, mtime_ns, size, inode, hash) "
+      "VALUES (?1, ?2, ?3, ?4, ?5, ?6) ON CONFLICT (root_id, path) "
+      "DO UPDATE SET mtime_ns = excluded.mtime_ns, size = excluded.size, "
+      "inode = excluded.inode, hash = excluded.hash");
+  m_selectRootDirs =
+      prepare("SELECT path, mtime_ns, inode, links FROM dirs "
+              "WHERE root_id = ?1");
+  m_upsertDir = prepare(
+      "INSERT INTO dirs (root_id, path, mtime_ns, inode, links) "
+      "VALUES (?1, ?2, ?3, ?4, ?5) ON CONFLICT (root_id, path) "
+      "DO UPDATE SET mtime_ns = excluded.mtime_ns, inode = excluded.inode, "
+      "links = excluded.links");
+  m_deleteDir = prepare("DELETE FROM dirs WHERE root_id = ?1 AND path = ?2");
+  m_selectMeta = prepare("SELECT value FROM meta WHERE key = ?1");
+  m_upsertMeta = prepare("INSERT INTO meta (key, value) VALUES (?1, ?2) "
+                         "ON CONFLICT (key) DO UPDATE SET value = "
+                         "excluded.value");
+  m_selectLedger = prepare("SELECT path, state, attempts, error FROM ledger");
+  m_upsertLedger = prepare(
+      "INSERT INTO ledger (path, state, attempts, error) "
+      "VALUES (?1, ?2, ?3, ?4) ON CONFLICT (path) DO UPDATE SET "
+      "state = excluded.state, attempts = excluded.attempts, "
+      "error = excluded.error");
+  m_deleteLedger = prepare("DELETE FROM ledger WHERE path = ?1");
+}
+
+SqliteManager::~SqliteManager() {
+  {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    commit();
+  }
+  for (sqlite3_stmt *statement :
+       {m_selectRoot, m_insertRoot, m_selectRootFiles, m_upsertFile,
+        m_selectRootDirs, m_upsertDir, m_deleteDir, m_selectMeta,
+        m_upsertMeta, m_selectLedger, m_upsertLedger, m_deleteLedger}) {
+    sqlite3_finalize(statement);
+  }
+  sqlite3_close(m_db);
+}
+
+void SqliteManager::exec(const char *sql) {
+  char *error = nullptr;
+  if (sqlite3_exec(m_db, sql, nullptr, nullptr, &error) != SQLITE_OK) {
+    std::string message = error ? error : sqlite3_errmsg(m_db);
+    sqlite3_free(error);
+    throw std::runtime_error("sqlite error in '" + std::string(sql) +
+                             "': " + message);
+  }
+}
+
+int64_t SqliteManager::queryInt(const char *sql) {
+  sqlite3_stmt *statement = nullptr;
+  if (sqlite3_prepare_v2(m_db, sql, -1, &statement, nullptr) != SQLITE_OK) {
+    throw std::runtime_error("sqlite error preparing '" + std::string(sql) +
+                             "': " + sqlite3_errmsg(m_db));
+  }
+  int64_t value = 0;
+  if (sqlite3_step(statement) == SQLITE_ROW)
+    value = sqlite3_column_int64(statement, 0);
+  sqlite3_finalize(statement);
+  return value;
+}
+
+void SqliteManager::migrateSchema() {
+  int64_t version = queryInt("PRAGMA user_version");
+  if (version >= SchemaVersion)
+    return;
+
+  exec("BEGIN");
+  if (version < 1 && queryInt("SELECT count(*) FROM pragma_table_info('files') "
+                              "WHERE name = 'time'") > 0) {
+    // time became a fingerprint. Old rows are left unknown, the next scan
+    // fills them in without treating the files as changed
+    exec("ALTER TABLE files ADD COLUMN mtime_ns INTEGER NOT NULL DEFAULT 0");
+    exec("ALTER TABLE files ADD COLUMN size INTEGER NOT NULL DEFAULT 0");
+    exec("ALTER TABLE files ADD COLUMN inode INTEGER NOT NULL DEFAULT 0");
+    exec("ALTER TABLE files ADD COLUMN hash INTEGER NOT NULL DEFAULT 0");
+    exec("ALTER TABLE files DROP COLUMN time");
+  }
+  if (version < 4 && queryInt("SELECT count(*) FROM pragma_table_info('dirs') "
+                              "WHERE name = 'links'") == 0) {
+    // no stamp matches until the next scan fills it in, one relisting each
+    exec("ALTER TABLE dirs ADD COLUMN links INTEGER NOT NULL DEFAULT 0");
+  }
+  // version 2 added the ledger table, 3 the dirs table, already created above
+  exec(("PRAGMA user_version = " + std::to_string(SchemaVersion)).c_str());
+  exec("COMMIT");
+}
+
+sqlite3_stmt *SqliteManager::prepare(const char *sql) {
+  sqlite3_stmt *statement = nullptr;
+  if (sqlite3_prepare_v3(m_db, sql, -1, SQLITE_PREPARE_PERSISTENT, &statement,
+                         nullptr) != SQLITE_OK) {
+    throw std::runtime_error("sqlite error preparing '" + std::string(sql) +
+                             "': " + sqlite3_errmsg(m_db));
+  }
+  return statement;
+}
+
+int64_t SqliteManager::getRootId(const std::string &root, bool create) {
+  auto cached = m_rootIds.find(root);
+  if (cached != m_rootIds.end())
+    return cached->second;
+
+  int64_t id = -1;
+  sqlite3_bind_text(m_selectRoot, 1, root.data(), root.size(),
+                    SQLITE_STATIC);
+  if (sqlite3_step(m_selectRoot) == SQLITE_ROW)
+    id = sqlite3_column_int64(m_selectRoot, 0);
+  sqlite3_reset(m_selectRoot);
+
+  if (id == -1 && create) {
+    sqlite3_bind_text(m_insertRoot, 1, root.data(), root.size(),
+                      SQLITE_STATIC);
+    if (sqlite3_step(m_insertRoot) == SQLITE_DONE) {
+      id = sqlite3_last_insert_rowid(m_db);
+    } else {
+      std::cerr << "Failed to add root " << root << ": "
+                << sqlite3_errmsg(m_db) << "\n";
+    }
+    sqlite3_reset(m_insertRoot);
+  }
+  if (id != -1)
+    m_rootIds[root] = id;
+  return id;
+}
+
+bool SqliteManager::beginWrite() {
+  if (m_inTransaction)
+    return true;
+  char *error = nullptr;
+  if (sqlite3_exec(m_db, "BEGIN", nullptr, nullptr, &error) != SQLITE_OK) {
+    std::cerr << "Failed to start backup transaction: "
+              << (error ? error : sqlite3_errmsg(m_db)) << "\n";
+    sqlite3_free(error);
+    return false;
+  }
+  m_inTransaction = true;
+  return true;
+}
+
+void SqliteManager::commit() {
+  if (!m_inTransaction)
+    return;
+  char *error = nullptr;
+  if (sqlite3_exec(m_db, "COMMIT", nullptr, nullptr, &error) != SQLITE_OK) {
+    std::cerr << "Failed to commit backup: "
+              << (error ? error : sqlite3_errmsg(m_db)) << "\n";
+    sqlite3_free(error);
+    sqlite3_exec(m_db, "ROLLBACK", nullptr, nullptr, nullptr);
+    // roots added since the last commit went with it
+    m_rootIds.clear();
+  }
+  m_inTransaction = false;
+  m_pendingWrites = 0;
+}
+
+void SqliteManager::wrote() {
+  if (++m_pendingWrites >= m_commitBatch)
+    commit();
+}
+
+EventId SqliteManager::getLastObservedEventId() {
+  std::lock_guard<std::mutex> lock(m_mutex);
+  EventId lastEvent = EventIdSinceNow;
+  sqlite3_bind_text(m_selectMeta, 1, "last_event_id", -1, SQLITE_STATIC);
+  if (sqlite3_step(m_selectMeta) == SQLITE_ROW) {
+    // stored as the signed 64 bit sqlite integer with the same bits
+    lastEvent =
+        static_cast<EventId>(sqlite3_column_int64(m_selectMeta, 0));
+  }
+  sqlite3_reset(m_selectMeta);
+  return lastEvent;
+}
+
+bool SqliteManager::isMonitoredRoot(fs::path path) {
+  std::lock_guard<std::mutex> lock(m_mutex);
+  return getRootId(path.string(), false) != -1;
+}
+
+void SqliteManager::forEachRootFile(
+    const fs::path &root,
+    const std::function<void(std::string_view, const FileFingerprint &)>
+        &visit) {
+  std::lock_guard<std::mutex> lock(m_mutex);
+  int64_t rootId = getRootId(root.string(), false);
+  if (rootId == -1)
+    return;
+
+  sqlite3_bind_int64(m_selectRootFiles, 1, rootId);
+  int result;
+  while ((result = sqlite3_step(m_selectRootFiles)) == SQLITE_ROW) {
+    // text is only valid until the next step, visit copies what it keeps
+    auto text = reinterpret_cast<const char *>(
+        sqlite3_column_text(m_selectRootFiles, 0));
+    int length = sqlite3_column_bytes(m_selectRootFiles, 0);
+    // unsigned fields stored as the signed 64 bit integer with the same bits
+    FileFingerprint fingerprint{
+        sqlite3_column_int64(m_selectRootFiles, 1),
+        static_cast<uint64_t>(sqlite3_column_int64(m_selectRootFiles, 2)),
+        static_cast<uint64_t>(sqlite3_column_int64(m_selectRootFiles, 3)),
+        static_cast<uint64_t>(sqlite3_column_int64(m_selectRootFiles, 4))};
+    visit(std::string_view(text, length), fingerprint);
+  }
+  if (result != SQLITE_DONE) {
+    std::cerr << "Failed to read files of " << root << ": "
+              << sqlite3_errmsg(m_db) << "\n";
+  }
+  sqlite3_reset(m_selectRootFiles);
+}
+
+void SqliteManager::forEachRootDir(
+    const fs::path &root,
+    const std::function<void(std::string_view, const DirStamp &)> &visit) {
+  std::lock_guard<std::mutex> lock(m_mutex);
+  int64_t rootId = getRootId(root.string(), false);
+  if (rootId == -1)
+    return;
+
+  sqlite3_bind_int64(m_selectRootDirs, 1, rootId);
+  int result;
+  while ((result = sqlite3_step(m_selectRootDirs)) == SQLITE_ROW) {
+    auto text = reinterpret_cast<const char *>(
+        sqlite3_column_text(m_selectRootDirs, 0));
+    int length = sqlite3_column_bytes(m_selectRootDirs, 0);
+    DirStamp stamp{
+        sqlite3_column_int64(m_selectRootDirs, 1),
+        static_cast<uint64_t>(sqlite3_column_int64(m_selectRootDirs, 2)),
+        static_cast<uint64_t>(sqlite3_column_int64(m_selectRootDirs, 3))};
+    visit(std::string_view(text, length), stamp);
+  }
+  if (result != SQLITE_DONE) {
+    std::cerr << "Failed to read folders of " << root << ": "
+              << sqlite3_errmsg(m_db) << "\n";
+  }
+  sqlite3_reset(m_selectRootDirs);
+}
+
+std::vector<std::pair<fs::path, FileFingerprint>>
+SqliteManager::getRootMonitoredFiles(fs::path path) {
+  std::vector<std::pair<fs::path, FileFingerprint>> pathsAndTimes;
+  forEachRootFile(path, [&](std::string_view file,
+                            const FileFingerprint &fingerprint) {
+    pathsAndTimes.emplace_back(file, fingerprint);
+  });
+  return pathsAndTimes;
+}
+
+void SqliteManager::getFolderManagerUpdate(FoldersManager &manager) {
+  std::lock_guard<std::mutex> lock(m_mutex);
+  if (!beginWrite())
+    return;
+  sqlite3_bind_text(m_upsertMeta, 1, "last_event_id", -1, SQLITE_STATIC);
+  sqlite3_bind_int64(m_upsertMeta, 2,
+                     static_cast<int64_t>(manager.getLatestEventId()));
+  if (sqlite3_step(m_upsertMeta) != SQLITE_DONE) {
+    std::cerr << "Failed to save last event id: " << sqlite3_errmsg(m_db)
+              << "\n";
+  }
+  sqlite3_reset(m_upsertMeta);
+}
+
+void SqliteManager::updateBackup() { flush(); }
+
+void SqliteManager::fileUpdated(const fs::path &root, const fs::path &path,
+                                const FileFingerprint &fingerprint) {
+  std::lock_guard<std::mutex> lock(m_mutex);
+  if (!beginWrite())
+    return;
+  int64_t rootId = getRootId(root.string(), true);
+  if (rootId == -1)
+    return;
+
+  const std::string &file = path.native();
+  sqlite3_bind_int64(m_upsertFile, 1, rootId);
+  sqlite3_bind_text(m_upsertFile, 2, file.data(), file.size(), SQLITE_STATIC);
+  sqlite3_bind_int64(m_upsertFile, 3, fingerprint.mtimeNs);
+  sqlite3_bind_int64(m_upsertFile, 4, static_cast<int64_t>(fingerprint.size));
+  sqlite3_bind_int64(m_upsertFile, 5, static_cast<int64_t>(fingerprint.inode));
+  sqlite3_bind_int64(m_upsertFile, 6,
+                     static_cast<int64_t>(fingerprint.contentHash));
+  if (sqlite3_step(m_upsertFile) != SQLITE_DONE) {
+    std::cerr << "Failed to save " << path << ": " << sqlite3_errmsg(m_db)
+              << "\n";
+  }
+  sqlite3_reset(m_upsertFile);
+  wrote();
+}
+
+void SqliteManager::dirUpdated(const fs::path &root, const fs::path &dir,
+                               const DirStamp &stamp) {
+  std::lock_guard<std::mutex> lock(m_mutex);
+  if (!beginWrite())
+    return;
+  int64_t rootId = getRootId(root.string(), true);
+  if (rootId == -1)
+    return;
+
+  const std::string &path = dir.native();
+  // unknown ones are just dropped, to be listed again
+  sqlite3_stmt *statement = stamp.isKnown() ? m_upsertDir : m_deleteDir;
+  sqlite3_bind_int64(statement, 1, rootId);
+  sqlite3_bind_text(statement, 2, path.data(), path.size(), SQLITE_STATIC);
+  if (stamp.isKnown()) {
+    sqlite3_bind_int64(statement, 3, stamp.mtimeNs);
+    sqlite3_bind_int64(statement, 4, static_cast<int64_t>(stamp.inode));
+    sqlite3_bind_int64(statement, 5, static_cast<int64_t>(stamp.linkCount));
+  }
+  if (sqlite3_step(statement) != SQLITE_DONE) {
+    std::cerr << "Failed to save " << dir << ": " << sqlite3_errmsg(m_db)
+              << "\n";
+  }
+  sqlite3_reset(statement);
+  wrote();
+}
+
+void SqliteManager::forEachLedgerEntry(
+    const std::function<void(std::string_view, const LedgerEntry &)> &visit) {
+  std::lock_guard<std::mutex> lock(m_mutex);
+  int result;
+  while ((result = sqlite3_step(m_selectLedger)) == SQLITE_ROW) {
+    auto text = reinterpret_cast<const char *>(
+        sqlite3_column_text(m_selectLedger, 0));
+    int length = sqlite3_column_bytes(m_selectLedger, 0);
+    int64_t state = sqlite3_column_int64(m_selectLedger, 1);
+    LedgerEntry entry;
+    // from a newer build maybe, take another look at the file
+    entry.state = state >= 0 && state < ProcessStateCount
+                      ? static_cast<ProcessState>(state)
+                      : ProcessDiscovered;
+    entry.attempts =
+        static_cast<uint32_t>(sqlite3_column_int64(m_selectLedger, 2));
+    auto error = reinterpret_cast<const char *>(
+        sqlite3_column_text(m_selectLedger, 3));
+    if (error)
+      entry.lastError.assign(error, sqlite3_column_bytes(m_selectLedger, 3));
+    visit(std::string_view(text, length), entry);
+  }
+  if (result != SQLITE_DONE) {
+    std::cerr << "Failed to read processing ledger: " << sqlite3_errmsg(m_db)
+              << "\n";
+  }
+  sqlite3_reset(m_selectLedger);
+}
+
+void SqliteManager::ledgerUpdated(const fs::path &path,
+                                  const LedgerEntry *entry) {
+  std::lock_guard<std::mutex> lock(m_mutex);
+  if (!beginWrite())
+    return;
+  const std::string &file = path.native();
+  sqlite3_stmt *statement = entry ? m_upsertLedger : m_deleteLedger;
+  sqlite3_bind_text(statement, 1, file.data(), file.size(), SQLITE_STATIC);
+  if (entry) {
+    sqlite3_bind_int64(statement, 2, entry->state);
+    sqlite3_bind_int64(statement, 3, entry->attempts);
+    sqlite3_bind_text(statement, 4, entry->lastError.data(),
+                      entry->lastError.size(), SQLITE_STATIC);
+  }
+  if (sqlite3_step(statement) != SQLITE_DONE) {
+    std::cerr << "Failed to save ledger entry for " << path << ": "
+              << sqlite3_errmsg(m_db) << "\n";
+  }
+  sqlite3_reset(statement);
+  wrote();
+}
+
+void SqliteManager::flush() {
+  std::lock_guard<std::mutex> lock(m_mutex);
+  commit();
+}
+
+} // namespace AN
@@ -0,0 +1,99 @@
+#pragma once
+#include "BackupManager.hpp"
+#include <cstdint>
+#include <filesystem>
+#include <mutex>
+#include <sqlite3.h>
+#include <string>
+#include <unordered_map>
+
+namespace AN {
+namespace fs = std::filesystem;
+
+// embedded sqlite database at <backupFile>.sqlite, schema:
+//   meta  (key TEXT PRIMARY KEY, value INTEGER)          eg last_event_id
+//   roots (id INTEGER PRIMARY KEY, path TEXT UNIQUE)
+//   files (root_id, path, mtime_ns, size, inode, hash,
+//          PRIMARY KEY (root_id, path)) WITHOUT ROWID
+//   dirs  (root_id, path, mtime_ns, inode, links,
+//          PRIMARY KEY (root_id, path)) WITHOUT ROWID, see DirStamp
+//   ledger (path TEXT PRIMARY KEY, state, attempts, error) WITHOUT ROWID
+//          see ProcessingLedger
+// so one root's files are a range scan of the primary key. Changes are
+// upserted as they happen, batched into one transaction until flush()
+class SqliteManager : public BackupManager {
+public:
+  // commit every commitBatch upserts even if nobody calls flush()
+  SqliteManager(fs::path backupFile, size_t commitBatch = 4096);
+  ~SqliteManager();
+
+  EventId getLastObservedEventId() override;
+
+  bool isMonitoredRoot(fs::path path) override;
+
+  std::vector<std::pair<fs::path, FileFingerprint>>
+  getRootMonitoredFiles(fs::path path) override;
+  void forEachRootFile(
+      const fs::path &root,
+      const std::function<void(std::string_view, const FileFingerprint &)>
+          &visit) override;
+  void forEachRootDir(
+      const fs::path &root,
+      const std::function<void(std::string_view, const DirStamp &)> &visit)
+      override;
+
+  void getFolderManagerUpdate(FoldersManager &manager) override;
+  // nothing to do, changes were upserted as they happened
+  void getFolderScannerUpdate(FolderScanner &) override {};
+  void updateBackup() override;
+
+  void fileUpdated(const fs::path &root, const fs::path &path,
+                   const FileFingerprint &fingerprint) override;
+  void dirUpdated(const fs::path &root, const fs::path &dir,
+                  const DirStamp &stamp) override;
+  void flush() override;
+
+  void forEachLedgerEntry(
+      const std::function<void(std::string_view, const LedgerEntry &)> &visit)
+      override;
+  void ledgerUpdated(const fs::path &path, const LedgerEntry *entry) override;
+
+private:
+  sqlite3 *m_db{nullptr};
+  size_t m_commitBatch;
+
+  std::mutex m_mutex; // everything below
+  bool m_inTransaction{false};
+  size_t m_pendingWrites{0};
+  std::unordered_map<std::string, int64_t> m_rootIds; // cache of roots table
+
+  sqlite3_stmt *m_selectRoot{nullptr};
+  sqlite3_stmt *m_insertRoot{nullptr};
+  sqlite3_stmt *m_selectRootFiles{nullptr};
+  sqlite3_stmt *m_upsertFile{nullptr};
+  sqlite3_stmt *m_selectRootDirs{nullptr};
+  sqlite3_stmt *m_upsertDir{nullptr};
+  sqlite3_stmt *m_deleteDir{nullptr};
+  sqlite3_stmt *m_selectMeta{nullptr};
+  sqlite3_stmt *m_upsertMeta{nullptr};
+  sqlite3_stmt *m_selectLedger{nullptr};
+  sqlite3_stmt *m_upsertLedger{nullptr};
+  sqlite3_stmt *m_deleteLedger{nullptr};
+
+  void exec(const char *sql);
+  // first column of the first row, 0 if none
+  int64_t queryInt(const char *sql);
+  sqlite3_stmt *prepare(const char *sql);
+  // bring a database from an older build up to date, see SchemaVersion
+  void migrateSchema();
+  // -1 if not there and !create
+  int64_t getRootId(const std::string &root, bool create);
+  // m_mutex must be held for these
+  // false (and logged) if no transaction could be started, skip the write
+  bool beginWrite();
+  void commit();
+  // commit if the open transaction is big enough
+  void wrote();
+};
+
+} // namespace AN
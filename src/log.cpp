@@ -1,4 +1,4 @@
-#include "Log.hpp"
+#include "log.hpp"
 
 #include <cstdlib>
 #include <fcntl.h>
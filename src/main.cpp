@@ -1,9 +1,10 @@
 #include "FoldersManager.hpp"
-#include "Log.hpp"
-#include <CoreServices/CoreServices.h>
+#include "log.hpp"
+#include <charconv>
 #include <cstdio>
 #include <cstdlib>
 #include <cstring>
+#include <fcntl.h>
 #include <filesystem>
 #include <ftw.h>
 #include <getopt.h>
@@ -49,6 +50,9 @@ int main(int argc, char *argv[]) {
     logger.logErr("failed to register sigaction");
     exit(EXIT_FAILURE);
   }
+  // a co-process (or client) going away mid write should be an EPIPE to deal
+  // with, not the end of us. cmds get the default back, see runProcess
+  signal(SIGPIPE, SIG_IGN);
   if (argc == 1) {
     logger.logErr("Need to specify one or more paths to monitor");
     exit(EXIT_FAILURE);
@@ -171,8 +175,52 @@ int main(int argc, char *argv[]) {
       logger.log("Connecting as client.");
       AN::FoldersManagerClient client;
       if (pArg == "list") {
-        std::string serverList = client.getServerNewFiles();
-        std::cout << "received: " << serverList << "\n";
+        // remaining args are filters, eg state=failed extension=.flac
+        AN::Json filter = AN::Json::object();
+        for (int i = optind; i < argc; ++i) {
+          std::string_view arg(argv[i]);
+          size_t equals = arg.find('=');
+          if (equals == std::string_view::npos) {
+            logger.logErr("Expected key=value filter, got " +
+                          std::string(arg));
+            exit(EXIT_FAILURE);
+          }
+          std::string key(arg.substr(0, equals));
+          std::string value(arg.substr(equals + 1));
+          if (key == "limit") {
+            unsigned long limit = 0;
+            auto [end, error] = std::from_chars(
+                value.data(), value.data() + value.size(), limit);
+            if (error != std::errc() || end != value.data() + value.size()) {
+              logger.logErr("Expected a number for limit, got " + value);
+              exit(EXIT_FAILURE);
+            }
+            filter[key] = limit;
+          } else {
+            filter[key] = value;
+          }
+        }
+        bool complete = client.listFiles(filter, [](std::string_view file) {
+          std::cout << file << "\n";
+        });
+        if (!complete)
+          exit(EXIT_FAILURE);
+      } else if (pArg == "deadletters") {
+        std::string deadLetters = client.getServerDeadLetters();
+        std::cout << "received:\n" << deadLetters;
+      } else if (pArg == "subscribe") {
+        client.subscribe([](std::string_view event) {
+          std::cout << event << std::endl; // may be piped, don't sit on them
+        });
+      } else if (pArg == "addroot" || pArg == "removeroot") {
+        if (optind >= argc) {
+          logger.logErr("Need a folder to " + pArg);
+          exit(EXIT_FAILURE);
+        }
+        std::string response = pArg == "addroot"
+                                   ? client.addServerRoot(argv[optind])
+                                   : client.removeServerRoot(argv[optind]);
+        std::cout << "received: " << response << "\n";
       } else if (pArg == "quit") {
         std::string response = client.doServerQuit();
         std::cout << "received: " << response << "\n";